@@ -32,6 +32,7 @@
 #include    "pound.h"
 
 #include    <openssl/x509v3.h>
+#include    <setjmp.h>
 
 #ifdef MISS_FACILITYNAMES
 
@@ -75,23 +76,16 @@ static CODE facilitynames[] = {
 
 static regex_t  Empty, Comment, User, Group, RootJail, Daemon, LogFacility, LogLevel, Alive, SSLEngine, Control;
 static regex_t  ListenHTTP, ListenHTTPS, End, Address, Port, Cert, xHTTP, Client, CheckURL;
-static regex_t  Err414, Err500, Err501, Err503, MaxRequest, HeadRemove, RewriteLocation, RewriteDestination;
+static regex_t  Err414, Err500, Err501, Err503, MaxRequest, MaxHeaderSize, MaxHeaders, BufferSize, Pipeline, RelayBudget, DeferAccept, Weight, ReservedThreads, MaxQueue, MaxQueueWait, HeadRemove, RewriteLocation, RewriteDestination;
 static regex_t  Service, ServiceName, URL, HeadRequire, HeadDeny, BackEnd, Emergency, Priority, HAport, HAportAddr;
 static regex_t  Redirect, RedirectN, TimeOut, Session, Type, TTL, ID, DynScale;
 static regex_t  ClientCert, AddHeader, DisableSSLv2, SSLAllowClientRenegotiation, SSLHonorCipherOrder, Ciphers;
 static regex_t  CAlist, VerifyList, CRLlist, NoHTTPS11, Grace, Include, ConnTO, IgnoreCase, HTTPS, HTTPSCert;
-static regex_t  Disabled, Threads, CNName, Anonymise;
+static regex_t  Disabled, Threads, CNName, Anonymise, EventThreads, Acceptors, MinThreads, MaxThreads, IdleTimeout;
+static regex_t  AcceptorCPUs, WorkerCPUs, ControlCPUs, Workers, Fibers, ParkKeepAlive;
 
 static regmatch_t   matches[5];
 
-static char *xhttp[] = {
-    "^(GET|POST|HEAD) ([^ ]+) HTTP/1.[01]$",
-    "^(GET|POST|HEAD|PUT|DELETE) ([^ ]+) HTTP/1.[01]$",
-    "^(GET|POST|HEAD|PUT|DELETE|LOCK|UNLOCK|PROPFIND|PROPPATCH|SEARCH|MKCOL|MOVE|COPY|OPTIONS|TRACE|MKACTIVITY|CHECKOUT|MERGE|REPORT) ([^ ]+) HTTP/1.[01]$",
-    "^(GET|POST|HEAD|PUT|DELETE|LOCK|UNLOCK|PROPFIND|PROPPATCH|SEARCH|MKCOL|MOVE|COPY|OPTIONS|TRACE|MKACTIVITY|CHECKOUT|MERGE|REPORT|SUBSCRIBE|UNSUBSCRIBE|BPROPPATCH|POLL|BMOVE|BCOPY|BDELETE|BPROPFIND|NOTIFY|CONNECT) ([^ ]+) HTTP/1.[01]$",
-    "^(GET|POST|HEAD|PUT|DELETE|LOCK|UNLOCK|PROPFIND|PROPPATCH|SEARCH|MKCOL|MOVE|COPY|OPTIONS|TRACE|MKACTIVITY|CHECKOUT|MERGE|REPORT|SUBSCRIBE|UNSUBSCRIBE|BPROPPATCH|POLL|BMOVE|BCOPY|BDELETE|BPROPFIND|NOTIFY|CONNECT|RPC_IN_DATA|RPC_OUT_DATA) ([^ ]+) HTTP/1.[01]$",
-};
-
 static int  log_level = 1;
 static int  def_facility = LOG_DAEMON;
 static int  clnt_to = 10;
@@ -107,16 +101,32 @@ static char *f_name[MAX_FIN];
 static int  n_lin[MAX_FIN];
 static int  cur_fin;
 
+/* reload: only the services are read again, and errors return to config_reload() */
+static char     *conf_name;
+static int      reloading = 0;
+static jmp_buf  reload_env;
+static SVC_CONF *reload_conf;
+static int      reload_lstn;
+
+static void
+conf_exit(void)
+{
+    if(reloading)
+        longjmp(reload_env, 1);
+    exit(1);
+}
+
 static int
 conf_init(const char *name)
 {
     if((f_name[0] = strdup(name)) == NULL) {
         logmsg(LOG_ERR, "open %s: out of memory", name);
-        exit(1);
+        conf_exit();
     }
     if((f_in[0] = fopen(name, "rt")) == NULL) {
         logmsg(LOG_ERR, "can't open open %s", name);
-        exit(1);
+        free(f_name[0]);
+        conf_exit();
     }
     n_lin[0] = 0;
     cur_fin = 0;
@@ -127,7 +137,7 @@ void
 conf_err(const char *msg)
 {
     logmsg(LOG_ERR, "%s line %d: %s", f_name[cur_fin], n_lin[cur_fin], msg);
-    exit(1);
+    conf_exit();
 }
 
 static char *
@@ -138,6 +148,7 @@ conf_fgets(char *buf, const int max)
     for(;;) {
         if(fgets(buf, max, f_in[cur_fin]) == NULL) {
             fclose(f_in[cur_fin]);
+            f_in[cur_fin] = NULL;
             free(f_name[cur_fin]);
             if(cur_fin > 0) {
                 cur_fin--;
@@ -385,6 +396,33 @@ parse_be(const int is_emergency)
     return NULL;
 }
 
+/*
+ * find a literal any match of the (case-insensitive, extended) pattern must contain - conservatively:
+ * the plain characters it starts with, unless there are alternatives anywhere in it
+ */
+static void
+set_literal(LITERAL *const lit, const char *pat)
+{
+    int n;
+
+    lit->len = lit->start = 0;
+    lit->str[0] = '\0';
+    if(strchr(pat, '|') != NULL)
+        return;
+    if(*pat == '^') {
+        lit->start = 1;
+        pat++;
+    }
+    for(n = 0; n < sizeof(lit->str) - 1 && pat[n] && strchr(".[]()*+?{}^$\\", pat[n]) == NULL; n++)
+        lit->str[n] = tolower((unsigned char)pat[n]);
+    /* the last one may be optional */
+    if(n > 0 && pat[n] && strchr("*+?{", pat[n]) != NULL)
+        n--;
+    lit->str[n] = '\0';
+    lit->len = n;
+    return;
+}
+
 /*
  * parse a session
  */
@@ -436,6 +474,7 @@ parse_sess(SERVICE *const svc)
                 snprintf(lin, MAXBUF - 1, "Cookie[^:]*:.*[ \t]%s=", parm);
                 if(regcomp(&svc->sess_start, lin, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("COOKIE pattern failed - aborted");
+                set_literal(&svc->sess_lit, lin);
                 if(regcomp(&svc->sess_pat, "([^;]*)", REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("COOKIE pattern failed - aborted");
             } else if(svc->sess_type == SESS_URL) {
@@ -452,12 +491,14 @@ parse_sess(SERVICE *const svc)
             } else if(svc->sess_type == SESS_BASIC) {
                 if(regcomp(&svc->sess_start, "Authorization:[ \t]*Basic[ \t]*", REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("BASIC pattern failed - aborted");
+                set_literal(&svc->sess_lit, "Authorization:[ \t]*Basic[ \t]*");
                 if(regcomp(&svc->sess_pat, "([^ \t]*)", REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("BASIC pattern failed - aborted");
             } else if(svc->sess_type == SESS_HEADER) {
                 snprintf(lin, MAXBUF - 1, "%s:[ \t]*", parm);
                 if(regcomp(&svc->sess_start, lin, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("HEADER pattern failed - aborted");
+                set_literal(&svc->sess_lit, lin);
                 if(regcomp(&svc->sess_pat, "([^ \t]*)", REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                     conf_err("HEADER pattern failed - aborted");
             }
@@ -570,6 +611,7 @@ parse_service(const char *svc_name)
             lin[matches[1].rm_eo] = '\0';
             if(regcomp(&m->pat, lin + matches[1].rm_so, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                 conf_err("HeadRequire bad pattern - aborted");
+            set_literal(&m->lit, lin + matches[1].rm_so);
         } else if(!regexec(&HeadDeny, lin, 4, matches, 0)) {
             if(res->deny_head) {
                 for(m = res->deny_head; m->next; m = m->next)
@@ -586,6 +628,7 @@ parse_service(const char *svc_name)
             lin[matches[1].rm_eo] = '\0';
             if(regcomp(&m->pat, lin + matches[1].rm_so, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                 conf_err("HeadDeny bad pattern - aborted");
+            set_literal(&m->lit, lin + matches[1].rm_so);
         } else if(!regexec(&Redirect, lin, 4, matches, 0)) {
             if(res->backends) {
                 for(be = res->backends; be->next; be = be->next)
@@ -716,8 +759,10 @@ parse_HTTP(void)
     res->err501 = "This method may not be used.";
     res->err503 = "The service is not available. Please try again later.";
     res->log_level = log_level;
-    if(regcomp(&res->verb, xhttp[0], REG_ICASE | REG_NEWLINE | REG_EXTENDED))
-        conf_err("xHTTP bad default pattern - aborted");
+    res->max_head = MAXBUF;
+    res->max_headers = MAXHEADERS - 1;
+    res->buf_size = MAXBUF;
+    res->relay_budget = RELAY_BUDGET;
     has_addr = has_port = 0;
     while(conf_fgets(lin, MAXBUF)) {
         if(strlen(lin) > 0 && lin[strlen(lin) - 1] == '\n')
@@ -746,12 +791,7 @@ parse_HTTP(void)
             }
             has_port = 1;
         } else if(!regexec(&xHTTP, lin, 4, matches, 0)) {
-            int n;
-
-            n = atoi(lin + matches[1].rm_so);
-            regfree(&res->verb);
-            if(regcomp(&res->verb, xhttp[n], REG_ICASE | REG_NEWLINE | REG_EXTENDED))
-                conf_err("xHTTP bad pattern - aborted");
+            res->xhttp = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&Client, lin, 4, matches, 0)) {
             res->to = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&CheckURL, lin, 4, matches, 0)) {
@@ -775,6 +815,35 @@ parse_HTTP(void)
             res->err503 = file2str(lin + matches[1].rm_so);
         } else if(!regexec(&MaxRequest, lin, 4, matches, 0)) {
             res->max_req = ATOL(lin + matches[1].rm_so);
+        } else if(!regexec(&MaxHeaderSize, lin, 4, matches, 0)) {
+            if((res->max_head = atoi(lin + matches[1].rm_so)) < 256 || res->max_head > 1048576)
+                conf_err("MaxHeaderSize must be between 256 and 1048576 - aborted");
+        } else if(!regexec(&MaxHeaders, lin, 4, matches, 0)) {
+            if((res->max_headers = atoi(lin + matches[1].rm_so)) > 65536)
+                conf_err("MaxHeaders must be at most 65536 - aborted");
+        } else if(!regexec(&BufferSize, lin, 4, matches, 0)) {
+            if((res->buf_size = atoi(lin + matches[1].rm_so)) < 512 || res->buf_size > 1048576)
+                conf_err("BufferSize must be between 512 and 1048576 - aborted");
+        } else if(!regexec(&Pipeline, lin, 4, matches, 0)) {
+            if((res->pipeline = atoi(lin + matches[1].rm_so)) > 64)
+                conf_err("Pipeline must be at most 64 - aborted");
+        } else if(!regexec(&RelayBudget, lin, 4, matches, 0)) {
+            if((res->relay_budget = atoi(lin + matches[1].rm_so)) > 1073741824)
+                conf_err("RelayBudget must be at most 1073741824 - aborted");
+        } else if(!regexec(&MaxQueue, lin, 4, matches, 0)) {
+            res->max_queue = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&MaxQueueWait, lin, 4, matches, 0)) {
+            res->max_wait = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&Weight, lin, 4, matches, 0)) {
+            res->weight = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&ReservedThreads, lin, 4, matches, 0)) {
+            res->reserved = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&DeferAccept, lin, 4, matches, 0)) {
+#ifdef  TCP_DEFER_ACCEPT
+            res->defer_accept = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("DeferAccept not supported on this platform - aborted");
+#endif
         } else if(!regexec(&HeadRemove, lin, 4, matches, 0)) {
             if(res->head_off) {
                 for(m = res->head_off; m->next; m = m->next)
@@ -791,6 +860,7 @@ parse_HTTP(void)
             lin[matches[1].rm_eo] = '\0';
             if(regcomp(&m->pat, lin + matches[1].rm_so, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                 conf_err("HeadRemove bad pattern - aborted");
+            set_literal(&m->lit, lin + matches[1].rm_so);
         } else if(!regexec(&AddHeader, lin, 4, matches, 0)) {
             lin[matches[1].rm_eo] = '\0';
             if(res->add_head == NULL) {
@@ -829,6 +899,9 @@ parse_HTTP(void)
         } else if(!regexec(&End, lin, 4, matches, 0)) {
             if(!has_addr || !has_port)
                 conf_err("ListenHTTP missing Address or Port - aborted");
+            /* reserved workers need a queue of their own */
+            if(res->reserved > 0 && res->weight == 0)
+                res->weight = 1;
             return res;
         } else {
             conf_err("unknown directive - aborted");
@@ -917,8 +990,10 @@ parse_HTTPS(void)
     res->allow_client_reneg = 0;
     res->disable_ssl_v2 = 0;
     res->log_level = log_level;
-    if(regcomp(&res->verb, xhttp[0], REG_ICASE | REG_NEWLINE | REG_EXTENDED))
-        conf_err("xHTTP bad default pattern - aborted");
+    res->max_head = MAXBUF;
+    res->max_headers = MAXHEADERS - 1;
+    res->buf_size = MAXBUF;
+    res->relay_budget = RELAY_BUDGET;
     has_addr = has_port = has_other = 0;
     while(conf_fgets(lin, MAXBUF)) {
         if(strlen(lin) > 0 && lin[strlen(lin) - 1] == '\n')
@@ -942,12 +1017,7 @@ parse_HTTPS(void)
             }
             has_port = 1;
         } else if(!regexec(&xHTTP, lin, 4, matches, 0)) {
-            int n;
-
-            n = atoi(lin + matches[1].rm_so);
-            regfree(&res->verb);
-            if(regcomp(&res->verb, xhttp[n], REG_ICASE | REG_NEWLINE | REG_EXTENDED))
-                conf_err("xHTTP bad pattern - aborted");
+            res->xhttp = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&Client, lin, 4, matches, 0)) {
             res->to = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&CheckURL, lin, 4, matches, 0)) {
@@ -971,6 +1041,35 @@ parse_HTTPS(void)
             res->err503 = file2str(lin + matches[1].rm_so);
         } else if(!regexec(&MaxRequest, lin, 4, matches, 0)) {
             res->max_req = ATOL(lin + matches[1].rm_so);
+        } else if(!regexec(&MaxHeaderSize, lin, 4, matches, 0)) {
+            if((res->max_head = atoi(lin + matches[1].rm_so)) < 256 || res->max_head > 1048576)
+                conf_err("MaxHeaderSize must be between 256 and 1048576 - aborted");
+        } else if(!regexec(&MaxHeaders, lin, 4, matches, 0)) {
+            if((res->max_headers = atoi(lin + matches[1].rm_so)) > 65536)
+                conf_err("MaxHeaders must be at most 65536 - aborted");
+        } else if(!regexec(&BufferSize, lin, 4, matches, 0)) {
+            if((res->buf_size = atoi(lin + matches[1].rm_so)) < 512 || res->buf_size > 1048576)
+                conf_err("BufferSize must be between 512 and 1048576 - aborted");
+        } else if(!regexec(&Pipeline, lin, 4, matches, 0)) {
+            if((res->pipeline = atoi(lin + matches[1].rm_so)) > 64)
+                conf_err("Pipeline must be at most 64 - aborted");
+        } else if(!regexec(&RelayBudget, lin, 4, matches, 0)) {
+            if((res->relay_budget = atoi(lin + matches[1].rm_so)) > 1073741824)
+                conf_err("RelayBudget must be at most 1073741824 - aborted");
+        } else if(!regexec(&MaxQueue, lin, 4, matches, 0)) {
+            res->max_queue = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&MaxQueueWait, lin, 4, matches, 0)) {
+            res->max_wait = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&Weight, lin, 4, matches, 0)) {
+            res->weight = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&ReservedThreads, lin, 4, matches, 0)) {
+            res->reserved = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&DeferAccept, lin, 4, matches, 0)) {
+#ifdef  TCP_DEFER_ACCEPT
+            res->defer_accept = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("DeferAccept not supported on this platform - aborted");
+#endif
         } else if(!regexec(&HeadRemove, lin, 4, matches, 0)) {
             if(res->head_off) {
                 for(m = res->head_off; m->next; m = m->next)
@@ -987,6 +1086,7 @@ parse_HTTPS(void)
             lin[matches[1].rm_eo] = '\0';
             if(regcomp(&m->pat, lin + matches[1].rm_so, REG_ICASE | REG_NEWLINE | REG_EXTENDED))
                 conf_err("HeadRemove bad pattern - aborted");
+            set_literal(&m->lit, lin + matches[1].rm_so);
         } else if(!regexec(&RewriteLocation, lin, 4, matches, 0)) {
             res->rewr_loc = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&RewriteDestination, lin, 4, matches, 0)) {
@@ -1193,6 +1293,9 @@ parse_HTTPS(void)
 
             if(!has_addr || !has_port || res->ctx == NULL)
                 conf_err("ListenHTTPS missing Address, Port or Certificate - aborted");
+            /* reserved workers need a queue of their own */
+            if(res->reserved > 0 && res->weight == 0)
+                res->weight = 1;
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
             if(!SSL_CTX_set_tlsext_servername_callback(res->ctx->ctx, SNI_server_name)
             || !SSL_CTX_set_tlsext_servername_arg(res->ctx->ctx, res->ctx))
@@ -1221,6 +1324,122 @@ parse_HTTPS(void)
     return NULL;
 }
 
+#if HAVE_PTHREAD_SETAFFINITY_NP
+/*
+ * parse a CPU list ("0-3,8,10-11") into a newly allocated set
+ */
+static cpu_set_t *
+parse_cpus(char *lst, const char *directive)
+{
+    cpu_set_t   *res;
+    char        *cp, msg[MAXBUF];
+    int         from, to;
+
+    if((res = (cpu_set_t *)malloc(sizeof(cpu_set_t))) == NULL) {
+        snprintf(msg, MAXBUF, "%s config: out of memory - aborted", directive);
+        conf_err(msg);
+    }
+    CPU_ZERO(res);
+    for(cp = lst; *cp; ) {
+        if(!isdigit(*cp))
+            break;
+        from = to = strtol(cp, &cp, 10);
+        if(*cp == '-' && isdigit(cp[1]))
+            to = strtol(cp + 1, &cp, 10);
+        if(from > to || to >= CPU_SETSIZE || (*cp && *cp != ','))
+            break;
+        for(; from <= to; from++)
+            CPU_SET(from, res);
+        if(*cp == ',')
+            cp++;
+    }
+    if(*cp || CPU_COUNT(res) == 0) {
+        snprintf(msg, MAXBUF, "%s bad CPU list - aborted", directive);
+        conf_err(msg);
+    }
+    return res;
+}
+#endif
+
+/*
+ * reload: read the services of the next listener - it must have the address of the running
+ * listener in the same position, anything else in its definition is ignored
+ */
+static void
+reload_listener(void)
+{
+    char            lin[MAXBUF];
+    LISTENER        *lstn;
+    SERVICE         **svc_p;
+    struct addrinfo addr;
+    int             i, port;
+
+    for(lstn = listeners, i = 0; lstn && i < reload_lstn; lstn = lstn->next, i++)
+        ;
+    if(lstn == NULL)
+        conf_err("listeners changed (restart or upgrade to apply) - reload aborted");
+    memset(&addr, 0, sizeof(addr));
+    port = 0;
+    while(conf_fgets(lin, MAXBUF)) {
+        if(strlen(lin) > 0 && lin[strlen(lin) - 1] == '\n')
+            lin[strlen(lin) - 1] = '\0';
+        if(!regexec(&Address, lin, 4, matches, 0)) {
+            lin[matches[1].rm_eo] = '\0';
+            if(addr.ai_addr == NULL && get_host(lin + matches[1].rm_so, &addr))
+                conf_err("Unknown Listener address");
+        } else if(!regexec(&Port, lin, 4, matches, 0)) {
+            port = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&Service, lin, 4, matches, 0)) {
+            for(svc_p = &reload_conf->lstn_svc[reload_lstn]; *svc_p; svc_p = &(*svc_p)->next)
+                ;
+            *svc_p = parse_service(NULL);
+        } else if(!regexec(&ServiceName, lin, 4, matches, 0)) {
+            lin[matches[1].rm_eo] = '\0';
+            for(svc_p = &reload_conf->lstn_svc[reload_lstn]; *svc_p; svc_p = &(*svc_p)->next)
+                ;
+            *svc_p = parse_service(lin + matches[1].rm_so);
+        } else if(!regexec(&End, lin, 4, matches, 0)) {
+            if(addr.ai_addr == NULL || addr.ai_family != lstn->addr.ai_family)
+                i = 1;
+            else if(addr.ai_family == AF_INET) {
+                ((struct sockaddr_in *)addr.ai_addr)->sin_port = (in_port_t)htons(port);
+                i = memcmp(addr.ai_addr, lstn->addr.ai_addr, sizeof(struct sockaddr_in));
+            } else {
+                ((struct sockaddr_in6 *)addr.ai_addr)->sin6_port = (in_port_t)htons(port);
+                i = memcmp(addr.ai_addr, lstn->addr.ai_addr, sizeof(struct sockaddr_in6));
+            }
+            if(addr.ai_addr != NULL)
+                free(addr.ai_addr);
+            if(i)
+                conf_err("listeners changed (restart or upgrade to apply) - reload aborted");
+            reload_lstn++;
+            return;
+        }
+    }
+
+    conf_err("Listener premature EOF");
+    return;
+}
+
+/*
+ * reload: is this a setting of the process (not applied on reload)?
+ */
+static int
+process_directive(const char *lin)
+{
+    static regex_t  *dirs[] = {
+        &User, &Group, &RootJail, &Daemon, &Threads, &MinThreads, &MaxThreads, &IdleTimeout,
+        &AcceptorCPUs, &WorkerCPUs, &ControlCPUs, &EventThreads, &ParkKeepAlive, &Fibers, &Workers, &Acceptors,
+        &LogFacility, &Grace, &Alive, &SSLEngine, &Control, &Anonymise, NULL
+    };
+    int             i;
+
+    for(i = 0; dirs[i]; i++)
+        if(!regexec(dirs[i], lin, 0, NULL, 0))
+            return 1;
+    return 0;
+}
+
 /*
  * parse the config file
  */
@@ -1228,7 +1447,7 @@ static void
 parse_file(void)
 {
     char        lin[MAXBUF];
-    SERVICE     *svc;
+    SERVICE     **svc_p;
     LISTENER    *lstn;
     int         i;
 #if HAVE_OPENSSL_ENGINE_H
@@ -1238,6 +1457,9 @@ parse_file(void)
     while(conf_fgets(lin, MAXBUF)) {
         if(strlen(lin) > 0 && lin[strlen(lin) - 1] == '\n')
             lin[strlen(lin) - 1] = '\0';
+        if(reloading && process_directive(lin))
+            /* the process settings stay as they are */
+            continue;
         if(!regexec(&User, lin, 4, matches, 0)) {
             lin[matches[1].rm_eo] = '\0';
             if((user = strdup(lin + matches[1].rm_so)) == NULL)
@@ -1254,6 +1476,59 @@ parse_file(void)
             daemonize = atoi(lin + matches[1].rm_so);
         } else if(!regexec(&Threads, lin, 4, matches, 0)) {
             numthreads = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&MinThreads, lin, 4, matches, 0)) {
+            min_threads = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&MaxThreads, lin, 4, matches, 0)) {
+            max_threads = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&IdleTimeout, lin, 4, matches, 0)) {
+            idle_to = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&AcceptorCPUs, lin, 4, matches, 0)) {
+#if HAVE_PTHREAD_SETAFFINITY_NP
+            lin[matches[1].rm_eo] = '\0';
+            acceptor_cpus = parse_cpus(lin + matches[1].rm_so, "AcceptorCPUs");
+#else
+            conf_err("AcceptorCPUs not supported on this platform - aborted");
+#endif
+        } else if(!regexec(&WorkerCPUs, lin, 4, matches, 0)) {
+#if HAVE_PTHREAD_SETAFFINITY_NP
+            lin[matches[1].rm_eo] = '\0';
+            worker_cpus = parse_cpus(lin + matches[1].rm_so, "WorkerCPUs");
+#else
+            conf_err("WorkerCPUs not supported on this platform - aborted");
+#endif
+        } else if(!regexec(&ControlCPUs, lin, 4, matches, 0)) {
+#if HAVE_PTHREAD_SETAFFINITY_NP
+            lin[matches[1].rm_eo] = '\0';
+            control_cpus = parse_cpus(lin + matches[1].rm_so, "ControlCPUs");
+#else
+            conf_err("ControlCPUs not supported on this platform - aborted");
+#endif
+        } else if(!regexec(&EventThreads, lin, 4, matches, 0)) {
+#if HAVE_SYS_EPOLL_H
+            evt_threads = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("EventThreads not supported on this platform - aborted");
+#endif
+        } else if(!regexec(&ParkKeepAlive, lin, 4, matches, 0)) {
+            park_keepalive = atoi(lin + matches[1].rm_so);
+        } else if(!regexec(&Fibers, lin, 4, matches, 0)) {
+#ifdef  FIBERS
+            fiber_threads = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("Fibers not supported on this platform - aborted");
+#endif
+        } else if(!regexec(&Workers, lin, 4, matches, 0)) {
+#ifdef  UPER
+            n_workers = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("Workers not supported without the supervisor process - aborted");
+#endif
+        } else if(!regexec(&Acceptors, lin, 4, matches, 0)) {
+#ifdef  SO_REUSEPORT
+            acceptors = atoi(lin + matches[1].rm_so);
+#else
+            conf_err("Acceptors not supported on this platform - aborted");
+#endif
         } else if(!regexec(&LogFacility, lin, 4, matches, 0)) {
             lin[matches[1].rm_eo] = '\0';
             if(lin[matches[1].rm_so] == '-')
@@ -1304,6 +1579,8 @@ parse_file(void)
                 conf_err("Control multiply defined - aborted");
             lin[matches[1].rm_eo] = '\0';
             ctrl_name = strdup(lin + matches[1].rm_so);
+        } else if(reloading && (!regexec(&ListenHTTP, lin, 4, matches, 0) || !regexec(&ListenHTTPS, lin, 4, matches, 0))) {
+            reload_listener();
         } else if(!regexec(&ListenHTTP, lin, 4, matches, 0)) {
             if(listeners == NULL)
                 listeners = parse_HTTP();
@@ -1321,22 +1598,14 @@ parse_file(void)
                 lstn->next = parse_HTTPS();
             }
         } else if(!regexec(&Service, lin, 4, matches, 0)) {
-            if(services == NULL)
-                services = parse_service(NULL);
-            else {
-                for(svc = services; svc->next; svc = svc->next)
-                    ;
-                svc->next = parse_service(NULL);
-            }
+            for(svc_p = reloading? &reload_conf->services: &services; *svc_p; svc_p = &(*svc_p)->next)
+                ;
+            *svc_p = parse_service(NULL);
         } else if(!regexec(&ServiceName, lin, 4, matches, 0)) {
             lin[matches[1].rm_eo] = '\0';
-            if(services == NULL)
-                services = parse_service(lin + matches[1].rm_so);
-            else {
-                for(svc = services; svc->next; svc = svc->next)
-                    ;
-                svc->next = parse_service(lin + matches[1].rm_so);
-            }
+            for(svc_p = reloading? &reload_conf->services: &services; *svc_p; svc_p = &(*svc_p)->next)
+                ;
+            *svc_p = parse_service(lin + matches[1].rm_so);
         } else if(!regexec(&Anonymise, lin, 4, matches, 0)) {
             anonymise = 1;
         } else {
@@ -1347,22 +1616,29 @@ parse_file(void)
 }
 
 /*
- * prepare to parse the arguments/config file
+ * compile/free the config file patterns
  */
-void
-config_parse(const int argc, char **const argv)
+static int
+init_regex(void)
 {
-    char    *conf_name;
-    FILE    *f_conf;
-    int     c_opt, check_only;
-
-    if(regcomp(&Empty, "^[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    return regcomp(&Empty, "^[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Comment, "^[ \t]*#.*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&User, "^[ \t]*User[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Group, "^[ \t]*Group[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&RootJail, "^[ \t]*RootJail[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Daemon, "^[ \t]*Daemon[ \t]+([01])[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Threads, "^[ \t]*Threads[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MinThreads, "^[ \t]*MinThreads[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MaxThreads, "^[ \t]*MaxThreads[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&IdleTimeout, "^[ \t]*IdleTimeout[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&AcceptorCPUs, "^[ \t]*AcceptorCPUs[ \t]+\"([0-9,-]+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&WorkerCPUs, "^[ \t]*WorkerCPUs[ \t]+\"([0-9,-]+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&ControlCPUs, "^[ \t]*ControlCPUs[ \t]+\"([0-9,-]+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&EventThreads, "^[ \t]*EventThreads[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&ParkKeepAlive, "^[ \t]*ParkKeepAlive[ \t]+([01])[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&Fibers, "^[ \t]*Fibers[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&Workers, "^[ \t]*Workers[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&Acceptors, "^[ \t]*Acceptors[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&LogFacility, "^[ \t]*LogFacility[ \t]+([a-z0-9-]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&LogLevel, "^[ \t]*LogLevel[ \t]+([0-5])[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Grace, "^[ \t]*Grace[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
@@ -1383,6 +1659,16 @@ config_parse(const int argc, char **const argv)
     || regcomp(&Err501, "^[ \t]*Err501[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Err503, "^[ \t]*Err503[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&MaxRequest, "^[ \t]*MaxRequest[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MaxHeaderSize, "^[ \t]*MaxHeaderSize[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MaxHeaders, "^[ \t]*MaxHeaders[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&BufferSize, "^[ \t]*BufferSize[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&Pipeline, "^[ \t]*Pipeline[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&RelayBudget, "^[ \t]*RelayBudget[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MaxQueue, "^[ \t]*MaxQueue[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&MaxQueueWait, "^[ \t]*MaxQueueWait[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&Weight, "^[ \t]*Weight[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&ReservedThreads, "^[ \t]*ReservedThreads[ \t]+([1-9][0-9]*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    || regcomp(&DeferAccept, "^[ \t]*DeferAccept[ \t]+([0-9]+)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&HeadRemove, "^[ \t]*HeadRemove[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&RewriteLocation, "^[ \t]*RewriteLocation[ \t]+([012])[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&RewriteDestination, "^[ \t]*RewriteDestination[ \t]+([01])[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
@@ -1421,8 +1707,112 @@ config_parse(const int argc, char **const argv)
     || regcomp(&HTTPSCert, "^[ \t]*HTTPS[ \t]+\"(.+)\"[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&Disabled, "^[ \t]*Disabled[ \t]+[01][ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&CNName, ".*[Cc][Nn]=([-*.A-Za-z0-9]+).*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    || regcomp(&Anonymise, "^[ \t]*Anonymise[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    ) {
+    || regcomp(&Anonymise, "^[ \t]*Anonymise[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED);
+}
+
+static void
+free_regex(void)
+{
+    regfree(&Empty);
+    regfree(&Comment);
+    regfree(&User);
+    regfree(&Group);
+    regfree(&RootJail);
+    regfree(&Daemon);
+    regfree(&Threads);
+    regfree(&MinThreads);
+    regfree(&MaxThreads);
+    regfree(&IdleTimeout);
+    regfree(&EventThreads);
+    regfree(&ParkKeepAlive);
+    regfree(&Fibers);
+    regfree(&AcceptorCPUs);
+    regfree(&WorkerCPUs);
+    regfree(&ControlCPUs);
+    regfree(&Acceptors);
+    regfree(&Workers);
+    regfree(&LogFacility);
+    regfree(&LogLevel);
+    regfree(&Grace);
+    regfree(&Alive);
+    regfree(&SSLEngine);
+    regfree(&Control);
+    regfree(&ListenHTTP);
+    regfree(&ListenHTTPS);
+    regfree(&End);
+    regfree(&Address);
+    regfree(&Port);
+    regfree(&Cert);
+    regfree(&xHTTP);
+    regfree(&Client);
+    regfree(&CheckURL);
+    regfree(&Err414);
+    regfree(&Err500);
+    regfree(&Err501);
+    regfree(&Err503);
+    regfree(&MaxRequest);
+    regfree(&MaxHeaderSize);
+    regfree(&MaxHeaders);
+    regfree(&BufferSize);
+    regfree(&Pipeline);
+    regfree(&RelayBudget);
+    regfree(&DeferAccept);
+    regfree(&Weight);
+    regfree(&MaxQueue);
+    regfree(&MaxQueueWait);
+    regfree(&ReservedThreads);
+    regfree(&HeadRemove);
+    regfree(&RewriteLocation);
+    regfree(&RewriteDestination);
+    regfree(&Service);
+    regfree(&ServiceName);
+    regfree(&URL);
+    regfree(&HeadRequire);
+    regfree(&HeadDeny);
+    regfree(&BackEnd);
+    regfree(&Emergency);
+    regfree(&Priority);
+    regfree(&TimeOut);
+    regfree(&HAport);
+    regfree(&HAportAddr);
+    regfree(&Redirect);
+    regfree(&RedirectN);
+    regfree(&Session);
+    regfree(&Type);
+    regfree(&TTL);
+    regfree(&ID);
+    regfree(&DynScale);
+    regfree(&ClientCert);
+    regfree(&AddHeader);
+    regfree(&SSLAllowClientRenegotiation);
+    regfree(&DisableSSLv2);
+    regfree(&SSLHonorCipherOrder);
+    regfree(&Ciphers);
+    regfree(&CAlist);
+    regfree(&VerifyList);
+    regfree(&CRLlist);
+    regfree(&NoHTTPS11);
+    regfree(&Include);
+    regfree(&ConnTO);
+    regfree(&IgnoreCase);
+    regfree(&HTTPS);
+    regfree(&HTTPSCert);
+    regfree(&Disabled);
+    regfree(&CNName);
+    regfree(&Anonymise);
+    return;
+}
+
+/*
+ * prepare to parse the arguments/config file
+ */
+void
+config_parse(const int argc, char **const argv)
+{
+    FILE    *f_conf;
+    int     c_opt, check_only;
+
+    if(init_regex()) {
         logmsg(LOG_ERR, "bad config Regex - aborted");
         exit(1);
     }
@@ -1499,6 +1889,13 @@ config_parse(const int argc, char **const argv)
     ctrl_name = NULL;
 
     numthreads = 128;
+    min_threads = max_threads = -1;
+    idle_to = 60;
+    evt_threads = 0;
+    park_keepalive = 0;
+    fiber_threads = 0;
+    acceptors = 0;
+    n_workers = 1;
     alive_to = 30;
     daemonize = 1;
     grace = 30;
@@ -1508,6 +1905,30 @@ config_parse(const int argc, char **const argv)
 
     parse_file();
 
+    /* without MinThreads/MaxThreads the pool has a fixed size of Threads */
+    if(min_threads < 0)
+        min_threads = (max_threads > 0 && max_threads < numthreads)? max_threads: numthreads;
+    if(max_threads < 0)
+        max_threads = min_threads > numthreads? min_threads: numthreads;
+    if(min_threads > max_threads) {
+        logmsg(LOG_ERR, "MinThreads %d greater than MaxThreads %d - aborted", min_threads, max_threads);
+        exit(1);
+    }
+    if(fiber_threads > 0 && evt_threads > 0) {
+        /* the fiber schedulers wait for the clients themselves */
+        logmsg(LOG_ERR, "Fibers and EventThreads are mutually exclusive - aborted");
+        exit(1);
+    }
+    if(park_keepalive && evt_threads == 0) {
+        logmsg(LOG_ERR, "ParkKeepAlive needs EventThreads - aborted");
+        exit(1);
+    }
+    if(ctrl_name != NULL && n_workers > 1) {
+        /* each worker process has its own sessions and back-end state - a command would reach just one */
+        logmsg(LOG_ERR, "Control and Workers greater than 1 are mutually exclusive - aborted");
+        exit(1);
+    }
+
     if(check_only) {
         logmsg(LOG_INFO, "Config file %s is OK", conf_name);
         exit(0);
@@ -1518,75 +1939,82 @@ config_parse(const int argc, char **const argv)
         exit(1);
     }
 
-    regfree(&Empty);
-    regfree(&Comment);
-    regfree(&User);
-    regfree(&Group);
-    regfree(&RootJail);
-    regfree(&Daemon);
-    regfree(&Threads);
-    regfree(&LogFacility);
-    regfree(&LogLevel);
-    regfree(&Grace);
-    regfree(&Alive);
-    regfree(&SSLEngine);
-    regfree(&Control);
-    regfree(&ListenHTTP);
-    regfree(&ListenHTTPS);
-    regfree(&End);
-    regfree(&Address);
-    regfree(&Port);
-    regfree(&Cert);
-    regfree(&xHTTP);
-    regfree(&Client);
-    regfree(&CheckURL);
-    regfree(&Err414);
-    regfree(&Err500);
-    regfree(&Err501);
-    regfree(&Err503);
-    regfree(&MaxRequest);
-    regfree(&HeadRemove);
-    regfree(&RewriteLocation);
-    regfree(&RewriteDestination);
-    regfree(&Service);
-    regfree(&ServiceName);
-    regfree(&URL);
-    regfree(&HeadRequire);
-    regfree(&HeadDeny);
-    regfree(&BackEnd);
-    regfree(&Emergency);
-    regfree(&Priority);
-    regfree(&TimeOut);
-    regfree(&HAport);
-    regfree(&HAportAddr);
-    regfree(&Redirect);
-    regfree(&RedirectN);
-    regfree(&Session);
-    regfree(&Type);
-    regfree(&TTL);
-    regfree(&ID);
-    regfree(&DynScale);
-    regfree(&ClientCert);
-    regfree(&AddHeader);
-    regfree(&SSLAllowClientRenegotiation);
-    regfree(&DisableSSLv2);
-    regfree(&SSLHonorCipherOrder);
-    regfree(&Ciphers);
-    regfree(&CAlist);
-    regfree(&VerifyList);
-    regfree(&CRLlist);
-    regfree(&NoHTTPS11);
-    regfree(&Include);
-    regfree(&ConnTO);
-    regfree(&IgnoreCase);
-    regfree(&HTTPS);
-    regfree(&HTTPSCert);
-    regfree(&Disabled);
-    regfree(&CNName);
-    regfree(&Anonymise);
+    free_regex();
 
     /* set the facility only here to ensure the syslog gets opened if necessary */
     log_facility = def_facility;
 
     return;
 }
+
+/*
+ * re-read the services (global and per listener) from the config file
+ *
+ * Everything else stays as it is: the process settings are skipped and of the listeners only
+ * the addresses are checked (they must be the same as before, in the same order). Returns NULL
+ * on any error - the running configuration is then not touched.
+ */
+SVC_CONF *
+config_reload(void)
+{
+    SVC_CONF    *res;
+    LISTENER    *lstn;
+    int         n;
+
+    if((res = (SVC_CONF *)calloc(1, sizeof(SVC_CONF))) == NULL) {
+        logmsg(LOG_ERR, "reload: out of memory");
+        return NULL;
+    }
+    for(lstn = listeners; lstn; lstn = lstn->next)
+        res->n_lstn++;
+    if((res->lstn_svc = (SERVICE **)calloc(res->n_lstn, sizeof(SERVICE *))) == NULL) {
+        logmsg(LOG_ERR, "reload: out of memory");
+        free(res);
+        return NULL;
+    }
+    if(init_regex()) {
+        logmsg(LOG_ERR, "reload: bad config Regex");
+        free(res->lstn_svc);
+        free(res);
+        return NULL;
+    }
+
+    /* the defaults as at the start of the initial parse */
+    log_level = 1;
+    clnt_to = 10;
+    be_to = 15;
+    be_connto = 15;
+    dynscale = 0;
+    ignore_case = 0;
+
+    reload_conf = res;
+    reload_lstn = 0;
+    cur_fin = -1;
+    reloading = 1;
+    if(setjmp(reload_env)) {
+        /* whatever was parsed so far is lost */
+        for(n = cur_fin; n >= 0; n--)
+            if(f_in[n] != NULL) {
+                fclose(f_in[n]);
+                f_in[n] = NULL;
+                free(f_name[n]);
+            }
+        reloading = 0;
+        free_regex();
+        free(res->lstn_svc);
+        free(res);
+        return NULL;
+    }
+    conf_init(conf_name);
+    parse_file();
+    reloading = 0;
+    free_regex();
+
+    if(reload_lstn != res->n_lstn) {
+        logmsg(LOG_ERR, "reload: listeners changed (restart or upgrade to apply) - reload aborted");
+        free(res->lstn_svc);
+        free(res);
+        return NULL;
+    }
+    return res;
+}
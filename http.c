@@ -46,6 +46,42 @@ err_reply(BIO *const c, const char *head, const char *txt)
     return;
 }
 
+/*
+ * Turn a client away without processing (queue over budget): 503 for HTTP, reset for HTTPS
+ *
+ * Runs in the acceptor, so nothing here may block.
+ */
+void
+reject_conn(thr_arg *arg)
+{
+    char            buf[MAXBUF];
+    struct linger   l;
+    int             n;
+
+    __sync_fetch_and_add(&arg->lstn->rejected, 1);
+    if(arg->conn != NULL) {
+        /* a parked keep-alive connection - the client may retry on a new one */
+        http_drop(arg);
+        return;
+    }
+    l.l_onoff = 0;
+    l.l_linger = 0;
+    if(arg->lstn->ctx == NULL
+    && (n = snprintf(buf, MAXBUF, err_response, h503, strlen(arg->lstn->err503), arg->lstn->err503)) < MAXBUF
+    && fcntl(arg->sock, F_SETFL, fcntl(arg->sock, F_GETFL, 0) | O_NONBLOCK) == 0) {
+        /* swallow what the client sent already - closing with unread data would reset the connection */
+        while(read(arg->sock, buf + n, MAXBUF - n) > 0)
+            ;
+        (void)write(arg->sock, buf, n);
+        shutdown(arg->sock, SHUT_WR);
+    } else
+        /* no time for an SSL handshake: reset */
+        l.l_onoff = 1;
+    setsockopt(arg->sock, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
+    close(arg->sock);
+    return;
+}
+
 /*
  * Reply with a redirect
  */
@@ -78,16 +114,125 @@ redirect_reply(BIO *const c, const char *url, const int code)
 }
 
 /*
- * Read and write some binary data
+ * Flush the output only if nothing more is waiting in the input: whatever arrived
+ * together goes out together, in as few writes as the output buffer allows
  */
 static int
-copy_bin(BIO *const cl, BIO *const be, LONG cont, LONG *res_bytes, const int no_write)
+flush_idle(BIO *const in, BIO *const out)
 {
-    char        buf[MAXBUF];
-    int         res;
+    if(BIO_pending(in) > 0)
+        return 0;
+    return BIO_flush(out) == 1? 0: -1;
+}
+
+/*
+ * the relay buffer of a connection for the bodies
+ */
+typedef struct {
+    char        *buf;       /* NULL: none - MAXBUF on the stack is used instead */
+    int         size;
+    LISTENER    *lstn;      /* whose budget it comes from */
+    int         piped;      /* pipe_fd is open */
+    int         pipe_fd[2]; /* for splice_data(), kept empty between bodies */
+} RELAY;
+
+/*
+ * Grow a relay buffer to size bytes, if the budget of its listener allows it
+ * (it is empty when this is called, so nothing needs to be kept)
+ */
+static void
+relay_grow(RELAY *const rl, const int size)
+{
+    char    *p;
+
+    if(size > RELAY_MAX)
+        return;
+    if(__sync_add_and_fetch(&rl->lstn->relay_used, size - rl->size) > rl->lstn->relay_budget
+    || (p = (char *)malloc(size)) == NULL) {
+        __sync_sub_and_fetch(&rl->lstn->relay_used, size - rl->size);
+        return;
+    }
+    if(rl->buf)
+        free(rl->buf);
+    rl->buf = p;
+    rl->size = size;
+    return;
+}
+
+/*
+ * give a relay buffer back to the budget
+ */
+static void
+relay_free(RELAY *const rl)
+{
+    if(rl->buf == NULL)
+        return;
+    free(rl->buf);
+    __sync_sub_and_fetch(&rl->lstn->relay_used, rl->size);
+    rl->buf = NULL;
+    rl->size = 0;
+    return;
+}
 
+/*
+ * close the splice pipe of a relay (if any)
+ */
+static void
+relay_unpipe(RELAY *const rl)
+{
+    if(!rl->piped)
+        return;
+    close(rl->pipe_fd[0]);
+    close(rl->pipe_fd[1]);
+    rl->piped = 0;
+    return;
+}
+
+/*
+ * Read up to n bytes, but only as much as there is right away: from the input buffer if it
+ * holds anything, else straight from the BIO under it (for SSL with whatever is decrypted already)
+ */
+static int
+relay_read(BIO *const in, char *const buf, const int n)
+{
+    BIO         *next;
+    int         res, more;
+
+    if((res = BIO_pending(in)) > 0 || (next = BIO_next(in)) == NULL)
+        return BIO_read(in, buf, res > 0 && res < n? res: n);
+    if((res = BIO_read(next, buf, n)) <= 0)
+        return res;
+    while(res < n && (more = BIO_pending(next)) > 0) {
+        if((more = BIO_read(next, buf + res, more < n - res? more: n - res)) <= 0)
+            break;
+        res += more;
+    }
+    return res;
+}
+
+/*
+ * Read and write some binary data - the output is flushed before waiting for more input.
+ * The data goes through the relay buffer rl (if given), which doubles while the reads fill it
+ */
+static int
+copy_data(BIO *const cl, BIO *const be, LONG cont, LONG *res_bytes, const int no_write, RELAY *const rl)
+{
+    char        sbuf[MAXBUF], *buf;
+    int         res, size;
+
+    if(rl != NULL && rl->buf == NULL && cont > MAXBUF)
+        relay_grow(rl, RELAY_MIN);
     while(cont > L0) {
-        if((res = BIO_read(cl, buf, cont > MAXBUF? MAXBUF: cont)) < 0)
+        if(!no_write && flush_idle(cl, be))
+            return -3;
+        if(rl != NULL && rl->buf != NULL) {
+            buf = rl->buf;
+            size = rl->size;
+        } else {
+            buf = sbuf;
+            size = MAXBUF;
+        }
+        if((res = relay_read(cl, buf, cont > size? size: cont)) < 0)
             return -1;
         else if(res == 0)
             return -2;
@@ -97,13 +242,42 @@ copy_bin(BIO *const cl, BIO *const be, LONG cont, LONG *res_bytes, const int no_
         cont -= res;
         if(res_bytes)
             *res_bytes += res;
+        if(buf != sbuf && res == size && cont > size)
+            relay_grow(rl, 2 * size);
     }
-    if(!no_write)
-        if(BIO_flush(be) != 1)
-            return -4;
     return 0;
 }
 
+/*
+ * Get a complete line straight from the input buffer of a BIO_f_buffer: the end of the line
+ * is found with memchr (vectorised in the C library) and only the line itself is copied out.
+ * Returns the length of the line including the LF (buf is NUL terminated), or 0 if the BIO has
+ * no buffer to look into or the line is not all in it yet - the caller then falls back to BIO_gets
+ */
+static int
+peek_line(BIO *const in, char *const buf, const int bufsize)
+{
+    char    *eol;
+    int     n, want, seen;
+
+    for(want = 128, seen = 0;; want *= 2) {
+        if(want > bufsize - 1)
+            want = bufsize - 1;
+        if((n = BIO_buffer_peek(in, buf, want)) <= seen)
+            return 0;
+        if((eol = (char *)memchr(buf + seen, '\n', n - seen)) != NULL) {
+            /* the line is in the buffer, so this cannot come up short */
+            n = eol - buf + 1;
+            BIO_read(in, buf, n);
+            buf[n] = '\0';
+            return n;
+        }
+        if(n < want || want == bufsize - 1)
+            return 0;
+        seen = n;
+    }
+}
+
 /*
  * Get a "line" from a BIO, strip the trailing newline, skip the input stream if buffer too small
  * The result buffer is NULL terminated
@@ -112,10 +286,19 @@ copy_bin(BIO *const cl, BIO *const be, LONG cont, LONG *res_bytes, const int no_
 static int
 get_line(BIO *const in, char *const buf, const int bufsize)
 {
-    char    tmp;
+    char    tmp, *eol;
     int     i, n_read;
 
-    memset(buf, 0, bufsize);
+    if((n_read = peek_line(in, buf, bufsize)) > 0) {
+        /* the line ends at the first CR or LF */
+        if((eol = (char *)memchr(buf, '\r', n_read)) == NULL)
+            eol = buf + n_read - 1;
+        *eol = '\0';
+        return 0;
+    }
+
+    /* BIO_gets() terminates what it read, so there is no need to clear all of buf */
+    *buf = '\0';
     for(n_read = 0;;)
         switch(BIO_gets(in, buf + n_read, bufsize - n_read - 1)) {
         case -2:
@@ -151,54 +334,134 @@ get_line(BIO *const in, char *const buf, const int bufsize)
 static int
 strip_eol(char *lin)
 {
-    while(*lin)
-        if(*lin == '\n' || (*lin == '\r' && *(lin + 1) == '\n')) {
-            *lin = '\0';
-            return 1;
-        } else
-            lin++;
+    char    *eol;
+
+    if((eol = strchr(lin, '\n')) == NULL)
+        return 0;
+    if(eol > lin && eol[-1] == '\r')
+        eol--;
+    *eol = '\0';
+    return 1;
+}
+
+/*
+ * Send the PEM certificate held in a memory BIO as the X-SSL-certificate header: one
+ * continuation line per PEM line, or all on one line with CERT1L.
+ * The lines are written straight out of the BIO memory.
+ */
+static int
+put_pem(BIO *const be, BIO *const pem)
+{
+    char    *p, *eol;
+    long    len;
+    int     n, l;
+
+    for(len = BIO_get_mem_data(pem, &p), n = 0; len > 0; n++, len -= eol - p + 1, p = eol + 1) {
+        if((eol = (char *)memchr(p, '\n', len)) == NULL)
+            eol = p + len;
+        l = eol - p;
+        if(l > 0 && p[l - 1] == '\r')
+            l--;
+#ifdef  CERT1L
+        if((n == 0 && BIO_puts(be, "X-SSL-certificate: ") <= 0) || BIO_write(be, p, l) != l)
+            return -1;
+#else
+        if((n == 0? BIO_puts(be, "X-SSL-certificate: "): BIO_write(be, "\t", 1)) <= 0
+        || BIO_write(be, p, l) != l || BIO_write(be, "\r\n", 2) != 2)
+            return -1;
+#endif
+    }
+#ifdef  CERT1L
+    if(BIO_write(be, "\r\n", 2) != 2)
+        return -1;
+#endif
     return 0;
 }
 
+/*
+ * Get the size from a chunk header: hex digits, possibly followed by extensions
+ * Returns -1 if there is no size (or it is too large)
+ */
+static LONG
+chunk_size(const char *lin)
+{
+    const char  *p;
+    LONG        cont;
+    int         d;
+
+    for(cont = L0, p = lin;; p++) {
+        if(*p >= '0' && *p <= '9')
+            d = *p - '0';
+        else if(*p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else if(*p >= 'A' && *p <= 'F')
+            d = *p - 'A' + 10;
+        else
+            break;
+        if(cont >> (sizeof(LONG) * 8 - 5))
+            return -1;
+        cont = cont * 16 + d;
+    }
+    return p > lin? cont: -1;
+}
+
+/*
+ * Write a line read by get_line with its CRLF (into the output buffer)
+ */
+static int
+put_line(BIO *const out, const char *lin)
+{
+    int     len;
+
+    len = strlen(lin);
+    return (len > 0 && BIO_write(out, lin, len) != len) || BIO_write(out, "\r\n", 2) != 2? -1: 0;
+}
+
 /*
  * Copy chunked
+ * The chunks are passed on as they come, but the output is only flushed when
+ * no more input is waiting, so a burst of small chunks goes out in a few writes
  */
 static int
-copy_chunks(BIO *const cl, BIO *const be, LONG *res_bytes, const int no_write, const LONG max_size)
+copy_chunks(BIO *const cl, BIO *const be, LONG *res_bytes, const int no_write, const LONG max_size, RELAY *const rl)
 {
     char        buf[MAXBUF];
     LONG        cont, tot_size;
-    regmatch_t  matches[2];
     int         res;
 
     for(tot_size = 0L;;) {
+        if(!no_write && flush_idle(cl, be)) {
+            logmsg(LOG_NOTICE, "(%lx) error write chunked: %s", pthread_self(), strerror(errno));
+            return -3;
+        }
         if((res = get_line(cl, buf, MAXBUF)) < 0) {
             logmsg(LOG_NOTICE, "(%lx) chunked read error: %s", pthread_self(), strerror(errno));
             return -1;
-        } else if(res > 0)
+        } else if(res > 0) {
             /* EOF */
+            if(!no_write)
+                BIO_flush(be);
             return 0;
-        if(!regexec(&CHUNK_HEAD, buf, 2, matches, 0))
-            cont = STRTOL(buf, NULL, 16);
-        else {
+        }
+        if((cont = chunk_size(buf)) < L0) {
             /* not chunk header */
             logmsg(LOG_NOTICE, "(%lx) bad chunk header <%s>: %s", pthread_self(), buf, strerror(errno));
             return -2;
         }
         if(!no_write)
-            if(BIO_printf(be, "%s\r\n", buf) <= 0) {
+            if(put_line(be, buf)) {
                 logmsg(LOG_NOTICE, "(%lx) error write chunked: %s", pthread_self(), strerror(errno));
                 return -3;
             }
 
         tot_size += cont;
         if(max_size > L0 && tot_size > max_size) {
-            logmsg(LOG_WARNING, "(%lx) chunk content too large", pthread_self);
+            logmsg(LOG_WARNING, "(%lx) chunk content too large", pthread_self());
                 return -4;
         }
 
         if(cont > L0) {
-            if(copy_bin(cl, be, cont, res_bytes, no_write)) {
+            if(copy_data(cl, be, cont, res_bytes, no_write, rl)) {
                 if(errno)
                     logmsg(LOG_NOTICE, "(%lx) error copy chunk cont: %s", pthread_self(), strerror(errno));
                 return -4;
@@ -216,7 +479,7 @@ copy_chunks(BIO *const cl, BIO *const be, LONG *res_bytes, const int no_write, c
         if(buf[0])
             logmsg(LOG_NOTICE, "(%lx) unexpected after chunk \"%s\"", pthread_self(), buf);
         if(!no_write)
-            if(BIO_printf(be, "%s\r\n", buf) <= 0) {
+            if(put_line(be, buf)) {
                 logmsg(LOG_NOTICE, "(%lx) error after chunk write: %s", pthread_self(), strerror(errno));
                 return -6;
             }
@@ -229,7 +492,7 @@ copy_chunks(BIO *const cl, BIO *const be, LONG *res_bytes, const int no_write, c
         } else if(res > 0)
             break;
         if(!no_write)
-            if(BIO_printf(be, "%s\r\n", buf) <= 0) {
+            if(put_line(be, buf)) {
                 logmsg(LOG_NOTICE, "(%lx) error post-chunk write: %s", pthread_self(), strerror(errno));
                 return -8;
             }
@@ -251,6 +514,37 @@ typedef struct {
     RENEG_STATE *reneg_state;
 } BIO_ARG;
 
+/*
+ * a request forwarded to the back-end - what passing its response on and logging it take
+ */
+typedef struct {
+    char        *request, *v_host, *referer, *u_agent, *u_name, *req_time;
+    char        *strs;      /* the strings above, if copied (see keep_strs) */
+    double      start_req;
+    SERVICE     *svc;
+    BACKEND     *backend;
+    int         cl_11, no_cont, is_rpc, conn_closed, force_10;
+} FWD_REQ;
+
+/*
+ * what a connection keeps between requests - the callbacks and SSL point into it,
+ * so it is on the heap when the connection may be parked
+ */
+typedef struct _http_conn {
+    BIO         *cl, *be;
+    SSL         *ssl;
+    X509        *x509;
+    BACKEND     *cur_backend;
+    RENEG_STATE reneg_state;
+    BIO_ARG     ba1, ba2;
+    HEADERS     headers;    /* of the current request */
+    HEADERS     resp;       /* of the current response */
+    char        *strs;      /* the request strings (see conn_strs) */
+    FWD_REQ     *ahead;     /* requests forwarded ahead, still waiting for their responses */
+    int         n_ahead;
+    RELAY       relay;      /* for the bodies */
+} HTTP_CONN;
+
 /*
  * Time-out for client read/gets
  * the SSL manual says not to do it, but it works well enough anyway...
@@ -281,14 +575,18 @@ bio_callback(BIO *const bio, const int cmd, const char *argp, int argi, long arg
         return -1;
     }
 
-    if (to == 0)
-        return ret;
+    if (to == 0) {
+        if(fiber_threads == 0)
+            return ret;
+        /* a fiber must not block its scheduler thread in read/write - wait without a time-out instead */
+        to = -1;
+    }
 
     for(;;) {
         memset(&p, 0, sizeof(p));
         BIO_get_fd(bio, &p.fd);
         p.events = (cmd == BIO_CB_READ)? (POLLIN | POLLPRI): POLLOUT;
-        p_res = poll(&p, 1, to);
+        p_res = fiber_poll(&p, to);
         p_err = errno;
         switch(p_res) {
         case 1:
@@ -357,82 +655,324 @@ is_readable(BIO *const bio, const int to_wait)
     memset(&p, 0, sizeof(p));
     BIO_get_fd(bio, &p.fd);
     p.events = POLLIN | POLLPRI;
-    return (poll(&p, 1, to_wait * 1000) > 0);
+    return (fiber_poll(&p, to_wait * 1000) > 0);
 }
 
-static void
-free_headers(char **headers)
+/* bodies smaller than this are not worth a pipe */
+#define SPLICE_MIN  (4 * MAXBUF)
+
+#ifdef  HAVE_SPLICE
+/* what a pipe holds by default */
+#define PIPE_SIZE   65536
+
+/*
+ * wait until the socket under a BIO is ready for cmd (BIO_CB_READ/BIO_CB_WRITE): with the time-out
+ * and fiber switching of BIO_read/BIO_write, or for as long as it takes if there is neither
+ */
+static int
+splice_wait(BIO *const sock, const int cmd)
 {
-    int     i;
+    BIO_ARG         *bio_arg;
+    struct pollfd   p;
+
+    if((bio_arg = (BIO_ARG *)BIO_get_callback_arg(sock)) != NULL && (bio_arg->timeout != 0 || fiber_threads > 0))
+        return bio_callback(sock, cmd, NULL, 0, 0L, 1L) == 1? 0: -1;
+    memset(&p, 0, sizeof(p));
+    BIO_get_fd(sock, &p.fd);
+    p.events = (cmd == BIO_CB_READ)? (POLLIN | POLLPRI): POLLOUT;
+    return (fiber_poll(&p, -1) < 0 && errno != EINTR)? -1: 0;
+}
+
+/*
+ * Move data from in to out through the pipe of rl with splice(), without copying it to user space.
+ * Only possible if both sides are plain sockets - returns 1 without doing anything otherwise.
+ * Moves cont bytes; with to_eof everything up to EOF, which must come within cont bytes
+ * (any number of them if cont is negative).
+ * Returns 0 when done, else as copy_data() (-5: more than cont bytes until EOF)
+ */
+static int
+splice_data(BIO *const in, BIO *const out, LONG cont, LONG *res_bytes, const int to_eof, RELAY *const rl)
+{
+    BIO         *in_sock, *out_sock;
+    int         in_fd, out_fd, in_fl, out_fl, res;
+    ssize_t     n, n_out, left;
+
+    if(BIO_find_type(in, BIO_TYPE_SSL) != NULL || BIO_find_type(out, BIO_TYPE_SSL) != NULL
+    || (in_sock = BIO_find_type(in, BIO_TYPE_SOCKET)) == NULL
+    || (out_sock = BIO_find_type(out, BIO_TYPE_SOCKET)) == NULL
+    || BIO_get_fd(in_sock, &in_fd) < 0 || BIO_get_fd(out_sock, &out_fd) < 0
+    || (in_fl = fcntl(in_fd, F_GETFL, 0)) < 0 || (out_fl = fcntl(out_fd, F_GETFL, 0)) < 0)
+        return 1;
+    if(!rl->piped) {
+        if(pipe(rl->pipe_fd))
+            return 1;
+        rl->piped = 1;
+    }
+
+    /* whatever is in the input buffer already goes first, through the BIOs */
+    if((n = BIO_pending(in)) > 0) {
+        if(cont >= L0 && n > cont) {
+            if(!to_eof)
+                n = cont;
+            else
+                return -5;
+        }
+        if((res = copy_data(in, out, n, res_bytes, 0, NULL)) != 0)
+            return res;
+        if(cont >= L0)
+            cont -= n;
+    }
+    if(BIO_flush(out) != 1)
+        return -4;
+
+    /*
+     * The sockets are blocking, and SPLICE_F_NONBLOCK only covers the pipe: they are switched to
+     * non-blocking for the loop, so that splice() never blocks and splice_wait() does the waiting,
+     * with the time-outs (and the fiber switching) of the BIOs.
+     */
+    if(fcntl(in_fd, F_SETFL, in_fl | O_NONBLOCK) < 0 || fcntl(out_fd, F_SETFL, out_fl | O_NONBLOCK) < 0) {
+        res = -1;
+        goto done;
+    }
+    for(res = 0; to_eof || cont > L0; ) {
+        n = (cont < L0 || cont >= PIPE_SIZE)? PIPE_SIZE: cont + (to_eof? 1: 0);
+        if((n = splice(in_fd, NULL, rl->pipe_fd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+            if(errno == EINTR || (errno == EAGAIN && splice_wait(in_sock, BIO_CB_READ) == 0))
+                continue;
+            res = -1;
+            break;
+        } else if(n == 0) {
+            if(!to_eof)
+                res = -2;
+            break;
+        } else if(cont >= L0 && n > cont) {
+            res = -5;
+            break;
+        }
+        for(left = n; left > 0; left -= n_out)
+            if((n_out = splice(rl->pipe_fd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+                if(errno != EINTR && (errno != EAGAIN || splice_wait(out_sock, BIO_CB_WRITE))) {
+                    res = -3;
+                    break;
+                }
+                n_out = 0;
+            }
+        if(res)
+            break;
+        if(cont >= L0)
+            cont -= n;
+        if(res_bytes)
+            *res_bytes += n;
+    }
+
+done:
+    if(fcntl(in_fd, F_SETFL, in_fl) < 0 || fcntl(out_fd, F_SETFL, out_fl) < 0)
+        res = -1;
+    if(res)
+        /* the pipe may hold data that never went out */
+        relay_unpipe(rl);
+    return res;
+}
+#else
+/* no splice() - the callers copy through the BIOs */
+#define splice_data(in, out, cont, res_bytes, to_eof, rl)   1
+#endif
+
+/*
+ * Read and write some binary data - large bodies are spliced if possible
+ */
+static int
+copy_bin(BIO *const cl, BIO *const be, LONG cont, LONG *res_bytes, const int no_write, RELAY *const rl)
+{
+    int         res;
+
+    if(!no_write && cont >= SPLICE_MIN && (res = splice_data(cl, be, cont, res_bytes, 0, rl)) != 1)
+        return res;
+    if((res = copy_data(cl, be, cont, res_bytes, no_write, rl)) != 0)
+        return res;
+    if(!no_write)
+        if(BIO_flush(be) != 1)
+            return -4;
+    return 0;
+}
+
+/*
+ * Copy everything up to EOF, at most max bytes (any number of them if max is negative) - spliced if possible.
+ * Whatever arrives goes on at once, through the relay buffer; the output is flushed whenever
+ * the input has nothing more ready. These streams may last long, but a peer that stops sending
+ * (or reading) is still given up on after the time-out of its BIO, spliced or not.
+ * Returns 0 at EOF, else as copy_data() (-5: more than max bytes)
+ */
+static int
+copy_eof(BIO *const in, BIO *const out, LONG max, LONG *res_bytes, RELAY *const rl)
+{
+    char        sbuf[MAXBUF], *buf;
+    int         res, size;
+
+    if((res = splice_data(in, out, max, res_bytes, 1, rl)) != 1)
+        return res;
+
+    if(rl->buf == NULL)
+        relay_grow(rl, RELAY_MIN);
+    for(;;) {
+        if(rl->buf != NULL) {
+            buf = rl->buf;
+            size = rl->size;
+        } else {
+            buf = sbuf;
+            size = MAXBUF;
+        }
+        if((res = relay_read(in, buf, size)) <= 0)
+            break;
+        if(max >= L0 && (max -= res) < L0)
+            return -5;
+        if(BIO_write(out, buf, res) != res)
+            return -3;
+        *res_bytes += res;
+        if(flush_idle(in, out))
+            return -3;
+        if(buf != sbuf && res == size)
+            relay_grow(rl, 2 * size);
+    }
+    return 0;
+}
+
+/*
+ * make room for a line of len bytes (plus the NUL) at the end of the header buffer
+ */
+static int
+hdr_room(HEADERS *const h, const int len)
+{
+    char    *p;
+    int     size;
+
+    if(h->used + len + 1 <= h->size)
+        return 0;
+    for(size = h->size? h->size: 2 * MAXBUF; size < h->used + len + 1; size *= 2)
+        ;
+    if((p = (char *)realloc(h->buf, size)) == NULL)
+        return -1;
+    h->buf = p;
+    h->size = size;
+    return 0;
+}
+
+/*
+ * replace header line n - the new one is added at the end of the buffer
+ */
+static int
+hdr_replace(HEADERS *const h, const int n, const char *line)
+{
+    int     len;
+
+    len = strlen(line);
+    if(hdr_room(h, len))
+        return -1;
+    memcpy(h->buf + h->used, line, len + 1);
+    h->off[n] = h->used;
+    h->len[n] = len;
+    h->type[n] = check_header(line, &h->val[n]);
+    h->used += len + 1;
+    return 0;
+}
+
+/*
+ * make room for max lines in the header index
+ */
+static int
+hdr_index(HEADERS *const h, const int max)
+{
+    int     *p;
+
+    if(h->max >= max)
+        return 0;
+    if((p = (int *)realloc(h->off, max * (4 * sizeof(int) + 1))) == NULL)
+        return -1;
+    h->off = p;
+    h->len = h->off + max;
+    h->type = h->len + max;
+    h->val = h->type + max;
+    h->ok = (char *)(h->val + max);
+    h->max = max;
+    return 0;
+}
 
-    for(i = 0; i < MAXHEADERS; i++)
-        if(headers[i])
-            free(headers[i]);
-    free(headers);
+static void
+free_headers(HEADERS *const h)
+{
+    if(h->buf)
+        free(h->buf);
+    if(h->off)
+        free(h->off);
+    memset(h, 0, sizeof(HEADERS));
     return;
 }
 
-static char **
-get_headers(BIO *const in, BIO *const cl, const LISTENER *lstn)
+/*
+ * read the request/status line and the headers into h, replacing what it held
+ * returns -1 on error (with a reply to the client if appropriate)
+ */
+static int
+get_headers(BIO *const in, BIO *const cl, const LISTENER *lstn, HEADERS *const h)
 {
-    char    **headers, buf[MAXBUF];
-    int     res, n, has_eol;
+    char    *lin;
+    int     res, has_eol;
+
+    h->n = h->used = 0;
+    if(hdr_index(h, lstn->max_headers + 1) || hdr_room(h, lstn->max_head)) {
+        logmsg(LOG_WARNING, "(%lx) e500 headers: out of memory", pthread_self());
+        err_reply(cl, h500, lstn->err500);
+        return -1;
+    }
 
     /* HTTP/1.1 allows leading CRLF */
-    memset(buf, 0, MAXBUF);
-    while((res = BIO_gets(in, buf, MAXBUF - 1)) > 0) {
-        has_eol = strip_eol(buf);
-        if(buf[0])
+    lin = h->buf;
+    *lin = '\0';
+    while((res = peek_line(in, lin, lstn->max_head - 1)) > 0 || (res = BIO_gets(in, lin, lstn->max_head - 1)) > 0) {
+        has_eol = strip_eol(lin);
+        if(lin[0])
             break;
     }
 
     if(res <= 0) {
         /* this is expected to occur only on client reads */
         /* logmsg(LOG_NOTICE, "headers: bad starting read"); */
-        return NULL;
+        return -1;
     } else if(!has_eol) {
         /* check for request length limit */
         logmsg(LOG_WARNING, "(%lx) e414 headers: request URI too long", pthread_self());
         err_reply(cl, h414, lstn->err414);
-        return NULL;
-    }
-    if((headers = (char **)calloc(MAXHEADERS, sizeof(char *))) == NULL) {
-        logmsg(LOG_WARNING, "(%lx) e500 headers: out of memory", pthread_self());
-        err_reply(cl, h500, lstn->err500);
-        return NULL;
-    }
-    if((headers[0] = (char *)malloc(MAXBUF)) == NULL) {
-        free_headers(headers);
-        logmsg(LOG_WARNING, "(%lx) e500 header: out of memory", pthread_self());
-        err_reply(cl, h500, lstn->err500);
-        return NULL;
+        return -1;
     }
-    memset(headers[0], 0, MAXBUF);
-    strncpy(headers[0], buf, MAXBUF - 1);
+    h->off[0] = 0;
+    h->len[0] = strlen(lin);
+    h->ok[0] = 1;
+    h->used = h->len[0] + 1;
 
-    for(n = 1; n < MAXHEADERS; n++) {
-        if(get_line(in, buf, MAXBUF)) {
-            free_headers(headers);
-            logmsg(LOG_WARNING, "(%lx) e500 can't read header", pthread_self());
+    for(h->n = 1; h->n <= lstn->max_headers; h->n++) {
+        if(hdr_room(h, lstn->max_head)) {
+            logmsg(LOG_WARNING, "(%lx) e500 header: out of memory", pthread_self());
             err_reply(cl, h500, lstn->err500);
-            return NULL;
+            return -1;
         }
-        if(!buf[0])
-            return headers;
-        if((headers[n] = (char *)malloc(MAXBUF)) == NULL) {
-            free_headers(headers);
-            logmsg(LOG_WARNING, "(%lx) e500 header: out of memory", pthread_self());
+        lin = h->buf + h->used;
+        if(get_line(in, lin, lstn->max_head)) {
+            logmsg(LOG_WARNING, "(%lx) e500 can't read header", pthread_self());
             err_reply(cl, h500, lstn->err500);
-            return NULL;
+            return -1;
         }
-        memset(headers[n], 0, MAXBUF);
-        strncpy(headers[n], buf, MAXBUF - 1);
+        if(!lin[0])
+            return 0;
+        h->off[h->n] = h->used;
+        h->len[h->n] = strlen(lin);
+        h->type[h->n] = check_header(lin, &h->val[h->n]);
+        h->ok[h->n] = 1;
+        h->used += h->len[h->n] + 1;
     }
 
-    free_headers(headers);
     logmsg(LOG_NOTICE, "(%lx) e500 too many headers", pthread_self());
     err_reply(cl, h500, lstn->err500);
-    return NULL;
+    return -1;
 }
 
 #define LOG_TIME_SIZE   32
@@ -490,71 +1030,53 @@ log_bytes(char *res, const LONG cnt)
     return;
 }
 
-/* Cleanup code. This should really be in the pthread_cleanup_push, except for bugs in some implementations */
+/* Cleanup code. This should really be in the pthread_cleanup_push, except for bugs in some implementations.
+ * The per-thread SSL error state stays with fibers: the other fibers of the scheduler thread use it too */
 
 #define clean_all() {   \
     if(ssl != NULL) { BIO_ssl_shutdown(cl); } \
     if(be != NULL) { BIO_flush(be); BIO_reset(be); BIO_free_all(be); be = NULL; } \
     if(cl != NULL) { BIO_flush(cl); BIO_reset(cl); BIO_free_all(cl); cl = NULL; } \
     if(x509 != NULL) { X509_free(x509); x509 = NULL; } \
-    if(ssl != NULL) { ERR_clear_error(); ERR_remove_state(0); } \
+    if(ssl != NULL) { ERR_clear_error(); if(fiber_threads == 0) ERR_remove_state(0); } \
 }
 
 /*
- * handle an HTTP request
+ * set up the client side of a new connection (SSL handshake, buffering) in conn
+ * returns -1 if that failed - the connection is closed then
  */
-void
-do_http(thr_arg *arg)
+static int
+open_client(thr_arg *arg, HTTP_CONN *conn)
 {
-    int                 cl_11, be_11, res, chunked, n, sock, no_cont, skip, conn_closed, force_10, sock_proto, is_rpc;
+    int                 sock;
     LISTENER            *lstn;
-    SERVICE             *svc;
-    BACKEND             *backend, *cur_backend, *old_backend;
-    struct addrinfo     from_host, z_addr;
+    struct addrinfo     from_host;
     struct sockaddr_storage from_host_addr;
-    BIO                 *cl, *be, *bb, *b64;
+    BIO                 *cl, *bb;
     X509                *x509;
-    char                request[MAXBUF], response[MAXBUF], buf[MAXBUF], url[MAXBUF], loc_path[MAXBUF], **headers,
-                        headers_ok[MAXHEADERS], v_host[MAXBUF], referer[MAXBUF], u_agent[MAXBUF], u_name[MAXBUF],
-                        caddr[MAXBUF], req_time[LOG_TIME_SIZE], s_res_bytes[LOG_BYTES_SIZE], *mh;
-    SSL                 *ssl, *be_ssl;
-    LONG                cont, res_bytes;
-    regmatch_t          matches[4];
-    struct linger       l;
-    double              start_req, end_req;
-    RENEG_STATE         reneg_state;
-    BIO_ARG             ba1, ba2;
-
-    reneg_state = RENEG_INIT;
-    ba1.reneg_state =  &reneg_state;
-    ba2.reneg_state = &reneg_state;
-    ba1.timeout = 0;
-    ba2.timeout = 0;
-    from_host = ((thr_arg *)arg)->from_host;
-    memcpy(&from_host_addr, from_host.ai_addr, from_host.ai_addrlen);
+    SSL                 *ssl;
+    char                caddr[MAXBUF];
+
+    conn->reneg_state = RENEG_INIT;
+    conn->ba1.reneg_state = &conn->reneg_state;
+    conn->ba2.reneg_state = &conn->reneg_state;
+    conn->ba1.timeout = 0;
+    conn->ba2.timeout = 0;
+    from_host = arg->from_host;
+    memcpy(&from_host_addr, &arg->from_addr, from_host.ai_addrlen);
     from_host.ai_addr = (struct sockaddr *)&from_host_addr;
-    lstn = ((thr_arg *)arg)->lstn;
-    sock = ((thr_arg *)arg)->sock;
-    free(((thr_arg *)arg)->from_host.ai_addr);
-    free(arg);
+    lstn = arg->lstn;
+    sock = arg->sock;
 
     if(lstn->allow_client_reneg)
-        reneg_state = RENEG_ALLOW;
-
-    n = 1;
-    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&n, sizeof(n));
-    l.l_onoff = 1;
-    l.l_linger = 10;
-    setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
-#ifdef  TCP_LINGER2
-    n = 5;
-    setsockopt(sock, SOL_TCP, TCP_LINGER2, (void *)&n, sizeof(n));
+        conn->reneg_state = RENEG_ALLOW;
+
+#ifndef INHERIT_SOCKOPTS
+    /* otherwise the options were set on the listener already */
+    set_sock_opts(sock);
 #endif
-    n = 1;
-    setsockopt(sock, SOL_TCP, TCP_NODELAY, (void *)&n, sizeof(n));
 
     cl = NULL;
-    be = NULL;
     ssl = NULL;
     x509 = NULL;
 
@@ -562,10 +1084,10 @@ do_http(thr_arg *arg)
         logmsg(LOG_WARNING, "(%lx) BIO_new_socket failed", pthread_self());
         shutdown(sock, 2);
         close(sock);
-        return;
+        return -1;
     }
-    ba1.timeout = lstn->to;
-    BIO_set_callback_arg(cl, (char *)&ba1);
+    conn->ba1.timeout = lstn->to;
+    BIO_set_callback_arg(cl, (char *)&conn->ba1);
     BIO_set_callback(cl, bio_callback);
 
     if(lstn->ctx != NULL) {
@@ -573,15 +1095,15 @@ do_http(thr_arg *arg)
             logmsg(LOG_WARNING, "(%lx) SSL_new: failed", pthread_self());
             BIO_reset(cl);
             BIO_free_all(cl);
-            return;
+            return -1;
         }
-        SSL_set_app_data(ssl, &reneg_state);
+        SSL_set_app_data(ssl, &conn->reneg_state);
         SSL_set_bio(ssl, cl, cl);
         if((bb = BIO_new(BIO_f_ssl())) == NULL) {
             logmsg(LOG_WARNING, "(%lx) BIO_new(Bio_f_ssl()) failed", pthread_self());
             BIO_reset(cl);
             BIO_free_all(cl);
-            return;
+            return -1;
         }
         BIO_set_ssl(bb, ssl, BIO_CLOSE);
         BIO_set_ssl_mode(bb, 0);
@@ -595,7 +1117,7 @@ do_http(thr_arg *arg)
             */
             BIO_reset(cl);
             BIO_free_all(cl);
-            return;
+            return -1;
         } else {
             if((x509 = SSL_get_peer_certificate(ssl)) != NULL && lstn->clnt_check < 3
             && SSL_get_verify_result(ssl) != X509_V_OK) {
@@ -603,32 +1125,467 @@ do_http(thr_arg *arg)
                 logmsg(LOG_NOTICE, "Bad certificate from %s", caddr);
                 BIO_reset(cl);
                 BIO_free_all(cl);
-                return;
+                return -1;
             }
         }
     } else {
         x509 = NULL;
     }
-    cur_backend = NULL;
 
-    if((bb = BIO_new(BIO_f_buffer())) == NULL) {
-        logmsg(LOG_WARNING, "(%lx) BIO_new(buffer) failed", pthread_self());
-        BIO_reset(cl);
-        BIO_free_all(cl);
-        return;
+    if((bb = BIO_new(BIO_f_buffer())) == NULL) {
+        logmsg(LOG_WARNING, "(%lx) BIO_new(buffer) failed", pthread_self());
+        BIO_reset(cl);
+        BIO_free_all(cl);
+        return -1;
+    }
+    BIO_set_close(cl, BIO_CLOSE);
+    BIO_set_buffer_size(bb, lstn->buf_size);
+    cl = BIO_push(bb, cl);
+
+    conn->cl = cl;
+    conn->be = NULL;
+    conn->ssl = ssl;
+    conn->x509 = x509;
+    conn->cur_backend = NULL;
+    return 0;
+}
+
+/* the request strings kept while serving a request, each big enough for a header of the listener */
+#define N_STRS      7
+/* the scratch buffer - big enough for a header with a host name and a path put in */
+#define BUF_SIZE(lstn)  (2 * (lstn)->max_head + MAXBUF)
+
+/*
+ * allocate the request strings of a connection (on first use, and again after it was parked)
+ */
+static int
+conn_strs(HTTP_CONN *const conn, const LISTENER *lstn)
+{
+    if(conn->strs == NULL)
+        conn->strs = (char *)malloc(N_STRS * lstn->max_head + BUF_SIZE(lstn));
+    return conn->strs == NULL? -1: 0;
+}
+
+/*
+ * release the buffers of an idle or finished connection
+ */
+static void
+free_conn(HTTP_CONN *const conn)
+{
+    free_headers(&conn->headers);
+    free_headers(&conn->resp);
+    if(conn->strs)
+        free(conn->strs);
+    conn->strs = NULL;
+    while(conn->n_ahead > 0)
+        free(conn->ahead[--conn->n_ahead].strs);
+    if(conn->ahead)
+        free(conn->ahead);
+    conn->ahead = NULL;
+    relay_free(&conn->relay);
+    relay_unpipe(&conn->relay);
+    return;
+}
+
+/*
+ * give a request forwarded ahead its own copy of the strings - the next request is read into the others
+ * returns -1 if out of memory
+ */
+static int
+keep_strs(FWD_REQ *const rq)
+{
+    char    **strs[6], *p;
+    size_t  len;
+    int     i;
+
+    strs[0] = &rq->request;
+    strs[1] = &rq->v_host;
+    strs[2] = &rq->referer;
+    strs[3] = &rq->u_agent;
+    strs[4] = &rq->u_name;
+    strs[5] = &rq->req_time;
+    for(len = 0, i = 0; i < 6; i++)
+        len += strlen(*strs[i]) + 1;
+    if((rq->strs = p = (char *)malloc(len)) == NULL)
+        return -1;
+    for(i = 0; i < 6; i++) {
+        len = strlen(*strs[i]) + 1;
+        memcpy(p, *strs[i], len);
+        *strs[i] = p;
+        p += len;
+    }
+    return 0;
+}
+
+/*
+ * is the head of a next request (pipelined by the client) all in the client input buffer already?
+ * It can then be read without waiting - and without running into the limits of the listener
+ */
+static int
+next_request(BIO *const cl, char *const buf, const int bufsize, const LISTENER *lstn)
+{
+    char    *lin, *eol, *end;
+    int     n, n_lines;
+
+    if(BIO_pending(cl) <= 0 || (n = BIO_buffer_peek(cl, buf, bufsize)) <= 0)
+        return 0;
+    end = buf + n;
+    /* HTTP/1.1 allows leading CRLF */
+    for(lin = buf; lin < end && (*lin == '\r' || *lin == '\n'); lin++)
+        ;
+    for(n_lines = 0; lin < end; lin = eol + 1) {
+        if((eol = (char *)memchr(lin, '\n', end - lin)) == NULL)
+            return 0;
+        if(eol == lin || (eol == lin + 1 && *lin == '\r'))
+            /* the empty line after the headers */
+            return n_lines > 0;
+        if(eol - lin >= lstn->max_head - 2 || ++n_lines > lstn->max_headers + 1)
+            return 0;
+    }
+    return 0;
+}
+
+/*
+ * read the response to rq from the back-end, pass it on to the client and log it
+ * returns -1 on error (the connection is then to be closed),
+ * 1 if the connection ends with this response, 0 if it may go on
+ */
+static int
+relay_response(thr_arg *arg, HTTP_CONN *conn, BIO *const cl, BIO **const bep, FWD_REQ *const rq,
+    struct addrinfo *from_host, char *const loc_path, char *const buf)
+{
+    int                 be_11, chunked, n, no_cont, skip, code;
+    LISTENER            *lstn;
+    BIO                 *be;
+    HEADERS             *resp;
+    char                *response, caddr[MAXBUF], s_res_bytes[LOG_BYTES_SIZE];
+    LONG                cont, res_bytes;
+    double              end_req;
+
+    lstn = arg->lstn;
+    be = *bep;
+    resp = &conn->resp;
+    no_cont = rq->no_cont;
+    res_bytes = L0;
+    for(skip = 1; skip;) {
+        if(get_headers(be, cl, lstn, resp)) {
+            str_be(buf, MAXBUF - 1, rq->backend);
+            end_req = cur_time();
+            addr2str(caddr, MAXBUF - 1, from_host, 1);
+            logmsg(LOG_NOTICE, "(%lx) e500 for %s response error read from %s/%s: %s (%.3f secs)",
+                pthread_self(), caddr, buf, rq->request, strerror(errno), (end_req - rq->start_req) / 1000000.0);
+            err_reply(cl, h500, lstn->err500);
+            return -1;
+        }
+
+        response = HDR(resp, 0);
+        be_11 = (response[7] == '1');
+        code = parse_status(response);
+        /* responses with code 100 are never passed back to the client */
+        skip = (code == 100 && be_11);
+        /* some response codes (1xx, 204, 304) have no content */
+        if(!no_cont && ((code > 100 && code < 200) || code == 204 || (code >= 304 && code <= 306)))
+            no_cont = 1;
+
+        for(chunked = 0, cont = -1L, n = 1; n < resp->n; n++) {
+            switch(resp->type[n]) {
+            case HEADER_CONNECTION:
+                if(!strcasecmp("close", HDR_VAL(resp, n)))
+                    rq->conn_closed = 1;
+                break;
+            case HEADER_TRANSFER_ENCODING:
+                if(!strcasecmp("chunked", HDR_VAL(resp, n))) {
+                    chunked = 1;
+                    no_cont = 0;
+                }
+                break;
+            case HEADER_CONTENT_LENGTH:
+                cont = ATOL(HDR_VAL(resp, n));
+                /* treat RPC_OUT_DATA like reply without content-length */
+                if(rq->is_rpc == 0 && cont == 0x40000000L)
+                    cont = -1L;
+                break;
+            case HEADER_LOCATION:
+                /* need_rewrite splits its argument - work on a copy */
+                strcpy(buf, HDR_VAL(resp, n));
+                if(rq->v_host[0] && need_rewrite(lstn->rewr_loc, buf, loc_path, rq->v_host, lstn, rq->backend)) {
+                    snprintf(buf, BUF_SIZE(lstn), "Location: %s://%s/%s",
+                        (conn->ssl == NULL? "http": "https"), rq->v_host, loc_path);
+                    if(hdr_replace(resp, n, buf)) {
+                        logmsg(LOG_WARNING, "(%lx) rewrite Location - out of memory: %s",
+                            pthread_self(), strerror(errno));
+                        return -1;
+                    }
+                }
+                break;
+            case HEADER_CONTLOCATION:
+                strcpy(buf, HDR_VAL(resp, n));
+                if(rq->v_host[0] && need_rewrite(lstn->rewr_loc, buf, loc_path, rq->v_host, lstn, rq->backend)) {
+                    snprintf(buf, BUF_SIZE(lstn), "Content-location: %s://%s/%s",
+                        (conn->ssl == NULL? "http": "https"), rq->v_host, loc_path);
+                    if(hdr_replace(resp, n, buf)) {
+                        logmsg(LOG_WARNING, "(%lx) rewrite Content-location - out of memory: %s",
+                            pthread_self(), strerror(errno));
+                        return -1;
+                    }
+                }
+                break;
+            }
+        }
+
+        /* possibly record session information (only for cookies/header) */
+        upd_session(rq->svc, resp, rq->backend);
+
+        /* send the response */
+        if(!skip)
+            for(n = 0; n < resp->n; n++) {
+                if(BIO_write(cl, HDR(resp, n), resp->len[n]) != resp->len[n] || BIO_write(cl, "\r\n", 2) != 2) {
+                    if(errno) {
+                        addr2str(caddr, MAXBUF - 1, from_host, 1);
+                        logmsg(LOG_NOTICE, "(%lx) error write to %s: %s", pthread_self(), caddr, strerror(errno));
+                    }
+                    return -1;
+                }
+            }
+
+        /* final CRLF */
+        if(!skip)
+            BIO_puts(cl, "\r\n");
+        if(BIO_flush(cl) != 1) {
+            if(errno) {
+                addr2str(caddr, MAXBUF - 1, from_host, 1);
+                logmsg(LOG_NOTICE, "(%lx) error flush headers to %s: %s", pthread_self(), caddr, strerror(errno));
+            }
+            return -1;
+        }
+
+        if(!no_cont) {
+            /* ignore this if request was HEAD or similar */
+            if(be_11 && chunked) {
+                /* had Transfer-encoding: chunked so read/write all the chunks (HTTP/1.1 only) */
+                if(copy_chunks(be, cl, &res_bytes, skip, L0, &conn->relay))
+                    /* copy_chunks() has its own error messages */
+                    return -1;
+            } else if(cont >= L0) {
+                /* may have had Content-length, so do raw reads/writes for the length */
+                if(copy_bin(be, cl, cont, &res_bytes, skip, &conn->relay)) {
+                    if(errno)
+                        logmsg(LOG_NOTICE, "(%lx) error copy server cont: %s", pthread_self(), strerror(errno));
+                    return -1;
+                }
+            } else if(!skip) {
+                if(is_readable(be, rq->backend->to)) {
+                    /*
+                     * old-style response - content until EOF
+                     * also implies the client may not use HTTP/1.1
+                     */
+                    rq->cl_11 = be_11 = 0;
+
+                    /*
+                     * copy till EOF
+                     */
+                    if(copy_eof(be, cl, -1, &res_bytes, &conn->relay)) {
+                        if(errno)
+                            logmsg(LOG_NOTICE, "(%lx) error copy response body: %s",
+                                pthread_self(), strerror(errno));
+                        return -1;
+                    }
+                }
+            }
+            if(BIO_flush(cl) != 1) {
+                /* client closes RPC_OUT_DATA connection - no error */
+                if(rq->is_rpc == 0 && res_bytes > 0L)
+                    break;
+                if(errno) {
+                    addr2str(caddr, MAXBUF - 1, from_host, 1);
+                    logmsg(LOG_NOTICE, "(%lx) error final flush to %s: %s", pthread_self(), caddr, strerror(errno));
+                }
+                return -1;
+            }
+        }
+    }
+    end_req = cur_time();
+    upd_be(rq->svc, rq->backend, end_req - rq->start_req);
+
+    /* log what happened */
+    memset(s_res_bytes, 0, LOG_BYTES_SIZE);
+    log_bytes(s_res_bytes, res_bytes);
+    addr2str(caddr, MAXBUF - 1, from_host, 1);
+    if(anonymise) {
+        char    *last;
+
+        if((last = strrchr(caddr, '.')) != NULL || (last = strrchr(caddr, ':')) != NULL)
+            strcpy(++last, "0");
+    }
+    str_be(buf, MAXBUF - 1, rq->backend);
+    response = HDR(resp, 0);
+    switch(lstn->log_level) {
+    case 0:
+        break;
+    case 1:
+        logmsg(LOG_INFO, "%s %s - %s", caddr, rq->request, response);
+        break;
+    case 2:
+        if(rq->v_host[0])
+            logmsg(LOG_INFO, "%s %s - %s (%s/%s -> %s) %.3f sec",
+                caddr, rq->request, response, rq->v_host, rq->svc->name[0]? rq->svc->name: "-", buf,
+                (end_req - rq->start_req) / 1000000.0);
+        else
+            logmsg(LOG_INFO, "%s %s - %s (%s -> %s) %.3f sec",
+                caddr, rq->request, response, rq->svc->name[0]? rq->svc->name: "-", buf,
+                (end_req - rq->start_req) / 1000000.0);
+        break;
+    case 3:
+        logmsg(LOG_INFO, "%s %s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\"",
+            rq->v_host[0]? rq->v_host: "-",
+            caddr, rq->u_name[0]? rq->u_name: "-", rq->req_time, rq->request, response[9],
+            response[10], response[11], s_res_bytes, rq->referer, rq->u_agent);
+        break;
+    case 4:
+        logmsg(LOG_INFO, "%s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\"",
+            caddr, rq->u_name[0]? rq->u_name: "-", rq->req_time, rq->request, response[9], response[10],
+            response[11], s_res_bytes, rq->referer, rq->u_agent);
+        break;
+    case 5:
+        logmsg(LOG_INFO, "%s %s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\" (%s -> %s) %.3f sec",
+            rq->v_host[0]? rq->v_host: "-",
+            caddr, rq->u_name[0]? rq->u_name: "-", rq->req_time, rq->request, response[9], response[10],
+            response[11], s_res_bytes, rq->referer, rq->u_agent, rq->svc->name[0]? rq->svc->name: "-", buf,
+            (end_req - rq->start_req) / 1000000.0);
+        break;
+    }
+
+    if(!be_11) {
+        BIO_reset(be);
+        BIO_free_all(be);
+        *bep = NULL;
+    }
+    /*
+     * Stop processing if:
+     *  - client is not HTTP/1.1
+     *      or
+     *  - we had a "Connection: closed" header
+     *      or
+     *  - this is an SSL connection and we had a NoHTTPS11 directive
+     */
+    return (!rq->cl_11 || rq->conn_closed || rq->force_10)? 1: 0;
+}
+
+/*
+ * pass on the responses to the requests forwarded ahead (in order), before anything else goes to the client
+ * returns as relay_response - 1 also if the back-end went away before all were answered
+ */
+static int
+drain_ahead(thr_arg *arg, HTTP_CONN *conn, BIO *const cl, BIO **const bep,
+    struct addrinfo *from_host, char *const loc_path, char *const buf)
+{
+    int     i, res;
+
+    if(conn->n_ahead == 0)
+        return 0;
+    res = 0;
+    if(BIO_flush(*bep) != 1) {
+        logmsg(LOG_NOTICE, "(%lx) error flush pipelined requests: %s", pthread_self(), strerror(errno));
+        res = -1;
     }
-    BIO_set_close(cl, BIO_CLOSE);
-    BIO_set_buffer_size(cl, MAXBUF);
-    cl = BIO_push(bb, cl);
+    for(i = 0; res == 0 && i < conn->n_ahead; i++)
+        if((res = relay_response(arg, conn, cl, bep, &conn->ahead[i], from_host, loc_path, buf)) == 0
+        && *bep == NULL && i < conn->n_ahead - 1)
+            res = 1;
+    while(conn->n_ahead > 0)
+        free(conn->ahead[--conn->n_ahead].strs);
+    return res;
+}
+
+/*
+ * an error reply of our own - after the responses to the requests forwarded ahead of it
+ */
+#define own_reply(code, text) { \
+    if(drain_ahead(arg, conn, cl, &be, &from_host, loc_path, buf) == 0) \
+        err_reply(cl, code, text); \
+}
+
+/*
+ * handle the requests on a connection
+ */
+static void
+serve_client(thr_arg *arg, HTTP_CONN *conn)
+{
+    int                 cl_11, res, chunked, n, sock, no_cont, conn_closed, force_10, sock_proto, is_rpc;
+    int                 may_park;
+    LISTENER            *lstn;
+    SERVICE             *svc;
+    BACKEND             *backend, *cur_backend, *old_backend;
+    struct addrinfo     from_host, z_addr;
+    struct sockaddr_storage from_host_addr;
+    BIO                 *cl, *be, *bb, *b64;
+    X509                *x509;
+    char                *request, *buf, *url, *loc_path, *headers_ok, *v_host, *referer, *u_agent, *u_name,
+                        caddr[MAXBUF], req_time[LOG_TIME_SIZE], s_res_bytes[LOG_BYTES_SIZE], *mh;
+    SSL                 *ssl, *be_ssl;
+    HEADERS             *headers;
+    LONG                cont, res_bytes;
+    regmatch_t          matches[4];
+    REQ_LINE            req_line;
+    FWD_REQ             fwd;
+    double              start_req, end_req;
 
-    for(cl_11 = be_11 = 0;;) {
+    from_host = arg->from_host;
+    memcpy(&from_host_addr, &arg->from_addr, from_host.ai_addrlen);
+    from_host.ai_addr = (struct sockaddr *)&from_host_addr;
+    lstn = arg->lstn;
+    cl = conn->cl;
+    be = conn->be;
+    ssl = conn->ssl;
+    x509 = conn->x509;
+    cur_backend = conn->cur_backend;
+    headers = &conn->headers;
+    conn->relay.lstn = lstn;
+
+    /* a parked connection is resumed only after a complete HTTP/1.1 request/response */
+    cl_11 = (arg->conn != NULL);
+    arg->conn = NULL;
+
+    for(may_park = 0;;) {
+        if(may_park && !is_readable(cl, 0)) {
+            /* nothing (buffered) from the client yet: wait for its next request in the event engine */
+            conn->cl = cl;
+            conn->be = be;
+            conn->ssl = ssl;
+            conn->x509 = x509;
+            conn->cur_backend = cur_backend;
+            /* an idle connection needs no buffers */
+            free_conn(conn);
+            arg->conn = conn;
+            if(evt_add(arg) == 0)
+                /* it may be running in another worker already - hands off */
+                return;
+            arg->conn = NULL;
+        }
+        /* the request strings - again if a failed parking freed them */
+        if(conn_strs(conn, lstn)) {
+            logmsg(LOG_WARNING, "(%lx) e500 request strings: out of memory", pthread_self());
+            err_reply(cl, h500, lstn->err500);
+            clean_all();
+            return;
+        }
+        request = conn->strs;
+        url = request + lstn->max_head;
+        loc_path = url + lstn->max_head;
+        v_host = loc_path + lstn->max_head;
+        referer = v_host + lstn->max_head;
+        u_agent = referer + lstn->max_head;
+        u_name = u_agent + lstn->max_head;
+        buf = u_name + lstn->max_head;
+        if(conn->relay.buf != NULL && !is_readable(cl, 0))
+            /* idle keep-alive: the relay buffer goes back to the budget */
+            relay_free(&conn->relay);
+        may_park = 0;
         res_bytes = L0;
         is_rpc = -1;
         v_host[0] = referer[0] = u_agent[0] = u_name[0] = '\0';
         conn_closed = 0;
-        for(n = 0; n < MAXHEADERS; n++)
-            headers_ok[n] = 1;
-        if((headers = get_headers(cl, cl, lstn)) == NULL) {
+        if(get_headers(cl, cl, lstn, headers)) {
             if(!cl_11) {
                 if(errno) {
                     addr2str(caddr, MAXBUF - 1, &from_host, 1);
@@ -644,62 +1601,60 @@ do_http(thr_arg *arg)
         log_time(req_time);
 
         /* check for correct request */
-        strncpy(request, headers[0], MAXBUF);
-        if(!regexec(&lstn->verb, request, 3, matches, 0)) {
-            no_cont = !strncasecmp(request + matches[1].rm_so, "HEAD", matches[1].rm_eo - matches[1].rm_so);
-            if(!strncasecmp(request + matches[1].rm_so, "RPC_IN_DATA", matches[1].rm_eo - matches[1].rm_so))
+        headers_ok = headers->ok;
+        strncpy(request, HDR(headers, 0), lstn->max_head);
+        if(!parse_request(request, lstn->xhttp, &req_line)) {
+            no_cont = (req_line.method == METH_HEAD);
+            if(req_line.method == METH_RPC_IN_DATA)
                 is_rpc = 1;
-            else if(!strncasecmp(request + matches[1].rm_so, "RPC_OUT_DATA", matches[1].rm_eo - matches[1].rm_so))
+            else if(req_line.method == METH_RPC_OUT_DATA)
                 is_rpc = 0;
         } else {
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_WARNING, "(%lx) e501 bad request \"%s\" from %s", pthread_self(), request, caddr);
-            err_reply(cl, h501, lstn->err501);
-            free_headers(headers);
+            own_reply(h501, lstn->err501);
             clean_all();
             return;
         }
-        cl_11 = (request[strlen(request) - 1] == '1');
-        n = cpURL(url, request + matches[2].rm_so, matches[2].rm_eo - matches[2].rm_so);
+        cl_11 = req_line.http11;
+        n = cpURL(url, request + req_line.url, req_line.url_len);
         if(n != strlen(url)) {
             /* the URL probably contained a %00 aka NULL - which we don't allow */
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_NOTICE, "(%lx) e501 URL \"%s\" (contains NULL) from %s", pthread_self(), url, caddr);
-            err_reply(cl, h501, lstn->err501);
-            free_headers(headers);
+            own_reply(h501, lstn->err501);
             clean_all();
             return;
         }
         if(lstn->has_pat && regexec(&lstn->url_pat,  url, 0, NULL, 0)) {
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_NOTICE, "(%lx) e501 bad URL \"%s\" from %s", pthread_self(), url, caddr);
-            err_reply(cl, h501, lstn->err501);
-            free_headers(headers);
+            own_reply(h501, lstn->err501);
             clean_all();
             return;
         }
 
         /* check other headers */
-        for(chunked = 0, cont = L_1, n = 1; n < MAXHEADERS && headers[n]; n++) {
-            /* no overflow - see check_header for details */
-            switch(check_header(headers[n], buf)) {
+        for(chunked = 0, cont = L_1, n = 1; n < headers->n; n++) {
+            /* no overflow - header lines are at most lstn->max_head bytes, as are the strings copied into */
+            switch(headers->type[n]) {
             case HEADER_HOST:
-                strcpy(v_host, buf);
+                strcpy(v_host, HDR_VAL(headers, n));
                 break;
             case HEADER_REFERER:
-                strcpy(referer, buf);
+                strcpy(referer, HDR_VAL(headers, n));
                 break;
             case HEADER_USER_AGENT:
-                strcpy(u_agent, buf);
+                strcpy(u_agent, HDR_VAL(headers, n));
                 break;
             case HEADER_CONNECTION:
-                if(!strcasecmp("close", buf))
+                if(!strcasecmp("close", HDR_VAL(headers, n)))
                     conn_closed = 1;
                 break;
             case HEADER_TRANSFER_ENCODING:
                 if(cont >= L0)
                     headers_ok[n] = 0;
-                else if(!strcasecmp("chunked", buf))
+                else if(!strcasecmp("chunked", HDR_VAL(headers, n)))
                     if(chunked)
                         headers_ok[n] = 0;
                     else
@@ -709,13 +1664,13 @@ do_http(thr_arg *arg)
                 if(chunked || cont >= 0L)
                     headers_ok[n] = 0;
                 else
-                    if((cont = ATOL(buf)) < 0L)
+                    if((cont = ATOL(HDR_VAL(headers, n))) < 0L)
                         headers_ok[n] = 0;
                 break;
             case HEADER_ILLEGAL:
                 if(lstn->log_level > 0) {
                     addr2str(caddr, MAXBUF - 1, &from_host, 1);
-                    logmsg(LOG_NOTICE, "(%lx) bad header from %s (%s)", pthread_self(), caddr, headers[n]);
+                    logmsg(LOG_NOTICE, "(%lx) bad header from %s (%s)", pthread_self(), caddr, HDR(headers, n));
                 }
                 headers_ok[n] = 0;
                 break;
@@ -725,11 +1680,11 @@ do_http(thr_arg *arg)
                 MATCHER *m;
 
                 for(m = lstn->head_off; m; m = m->next)
-                    if(!(headers_ok[n] = regexec(&m->pat, headers[n], 0, NULL, 0)))
+                    if(has_literal(&m->lit, HDR(headers, n)) && !(headers_ok[n] = regexec(&m->pat, HDR(headers, n), 0, NULL, 0)))
                         break;
             }
             /* get User name */
-            if(!regexec(&AUTHORIZATION, headers[n], 2, matches, 0)) {
+            if(headers->type[n] == HEADER_AUTHORIZATION && !regexec(&AUTHORIZATION, HDR(headers, n), 2, matches, 0)) {
                 int inlen;
 
                 if((bb = BIO_new(BIO_s_mem())) == NULL) {
@@ -742,13 +1697,14 @@ do_http(thr_arg *arg)
                     continue;
                 }
                 b64 = BIO_push(b64, bb);
-                BIO_write(bb, headers[n] + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
+                BIO_write(bb, HDR(headers, n) + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
                 BIO_write(bb, "\n", 1);
-                if((inlen = BIO_read(b64, buf, MAXBUF - 1)) <= 0) {
+                if((inlen = BIO_read(b64, buf, lstn->max_head - 1)) <= 0) {
                     logmsg(LOG_WARNING, "(%lx) Can't read BIO_f_base64", pthread_self());
                     BIO_free_all(b64);
                     continue;
                 }
+                buf[inlen] = '\0';
                 BIO_free_all(b64);
                 if((mh = strchr(buf, ':')) == NULL) {
                     logmsg(LOG_WARNING, "(%lx) Unknown authentication", pthread_self());
@@ -763,39 +1719,50 @@ do_http(thr_arg *arg)
         if(lstn->max_req > L0 && cont > L0 && cont > lstn->max_req && is_rpc != 1) {
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_NOTICE, "(%lx) e501 request too large (%ld) from %s", pthread_self(), cont, caddr);
-            err_reply(cl, h501, lstn->err501);
-            free_headers(headers);
+            own_reply(h501, lstn->err501);
             clean_all();
             return;
         }
 
-        if(be != NULL) {
-            if(is_readable(be, 0)) {
-                /* The only way it's readable is if it's at EOF, so close it! */
-                BIO_reset(be);
-                BIO_free_all(be);
-                be = NULL;
-            }
-        }
-
         /* check that the requested URL still fits the old back-end (if any) */
-        if((svc = get_service(lstn, url, &headers[1])) == NULL) {
+        if((svc = get_service(((thr_arg *)arg)->conf, lstn, url, headers)) == NULL) {
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_NOTICE, "(%lx) e503 no service \"%s\" from %s %s", pthread_self(), request, caddr, v_host[0]? v_host: "-");
-            err_reply(cl, h503, lstn->err503);
-            free_headers(headers);
+            own_reply(h503, lstn->err503);
             clean_all();
             return;
         }
-        if((backend = get_backend(svc, &from_host, url, &headers[1])) == NULL) {
+        if((backend = get_backend(svc, &from_host, url, headers)) == NULL) {
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             logmsg(LOG_NOTICE, "(%lx) e503 no back-end \"%s\" from %s %s", pthread_self(), request, caddr, v_host[0]? v_host: "-");
-            err_reply(cl, h503, lstn->err503);
-            free_headers(headers);
+            own_reply(h503, lstn->err503);
             clean_all();
             return;
         }
 
+        /*
+         * with requests forwarded ahead this one may follow them only if it is a GET or HEAD
+         * for the same back-end - otherwise their responses must be passed on first
+         */
+        if(conn->n_ahead > 0 && (backend != cur_backend || backend->be_type || chunked || cont > L0
+        || (req_line.method != METH_GET && req_line.method != METH_HEAD))) {
+            if((res = drain_ahead(arg, conn, cl, &be, &from_host, loc_path, buf)) < 0) {
+                clean_all();
+                return;
+            }
+            if(res > 0)
+                break;
+        }
+
+        if(be != NULL && conn->n_ahead == 0) {
+            if(is_readable(be, 0)) {
+                /* The only way it's readable is if it's at EOF, so close it! */
+                BIO_reset(be);
+                BIO_free_all(be);
+                be = NULL;
+            }
+        }
+
         if(be != NULL && backend != cur_backend) {
             BIO_reset(be);
             BIO_free_all(be);
@@ -815,7 +1782,6 @@ do_http(thr_arg *arg)
             default:
                 logmsg(LOG_WARNING, "(%lx) e503 backend: unknown family %d", pthread_self(), backend->addr.ai_family);
                 err_reply(cl, h503, lstn->err503);
-                free_headers(headers);
                 clean_all();
                 return;
             }
@@ -823,7 +1789,6 @@ do_http(thr_arg *arg)
                 str_be(buf, MAXBUF - 1, backend);
                 logmsg(LOG_WARNING, "(%lx) e503 backend %s socket create: %s", pthread_self(), buf, strerror(errno));
                 err_reply(cl, h503, lstn->err503);
-                free_headers(headers);
                 clean_all();
                 return;
             }
@@ -843,49 +1808,36 @@ do_http(thr_arg *arg)
                  * ...but make sure we don't get into a loop with the same back-end
                  */
                 old_backend = backend;
-                if((backend = get_backend(svc, &from_host, url, &headers[1])) == NULL || backend == old_backend) {
+                if((backend = get_backend(svc, &from_host, url, headers)) == NULL || backend == old_backend) {
                     addr2str(caddr, MAXBUF - 1, &from_host, 1);
                     logmsg(LOG_NOTICE, "(%lx) e503 no back-end \"%s\" from %s", pthread_self(), request, caddr);
                     err_reply(cl, h503, lstn->err503);
-                    free_headers(headers);
                     clean_all();
                     return;
                 }
                 continue;
             }
-            if(sock_proto == PF_INET || sock_proto == PF_INET6) {
-                n = 1;
-                setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&n, sizeof(n));
-                l.l_onoff = 1;
-                l.l_linger = 10;
-                setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
-#ifdef  TCP_LINGER2
-                n = 5;
-                setsockopt(sock, SOL_TCP, TCP_LINGER2, (void *)&n, sizeof(n));
-#endif
-                n = 1;
-                setsockopt(sock, SOL_TCP, TCP_NODELAY, (void *)&n, sizeof(n));
-            }
+            if(sock_proto == PF_INET || sock_proto == PF_INET6)
+                set_sock_opts(sock);
             if((be = BIO_new_socket(sock, 1)) == NULL) {
                 logmsg(LOG_WARNING, "(%lx) e503 BIO_new_socket server failed", pthread_self());
                 shutdown(sock, 2);
                 close(sock);
                 err_reply(cl, h503, lstn->err503);
-                free_headers(headers);
                 clean_all();
                 return;
             }
             BIO_set_close(be, BIO_CLOSE);
-            if(backend->to > 0) {
-                ba2.timeout = backend->to;
-                BIO_set_callback_arg(be, (char *)&ba2);
+            /* fibers always need the callback, as it is where they yield */
+            if(backend->to > 0 || fiber_threads > 0) {
+                conn->ba2.timeout = backend->to;
+                BIO_set_callback_arg(be, (char *)&conn->ba2);
                 BIO_set_callback(be, bio_callback);
             }
             if(backend->ctx != NULL) {
                 if((be_ssl = SSL_new(backend->ctx)) == NULL) {
                     logmsg(LOG_WARNING, "(%lx) be SSL_new: failed", pthread_self());
                     err_reply(cl, h503, lstn->err503);
-                    free_headers(headers);
                     clean_all();
                     return;
                 }
@@ -893,7 +1845,6 @@ do_http(thr_arg *arg)
                 if((bb = BIO_new(BIO_f_ssl())) == NULL) {
                     logmsg(LOG_WARNING, "(%lx) BIO_new(Bio_f_ssl()) failed", pthread_self());
                     err_reply(cl, h503, lstn->err503);
-                    free_headers(headers);
                     clean_all();
                     return;
                 }
@@ -905,7 +1856,6 @@ do_http(thr_arg *arg)
                     logmsg(LOG_NOTICE, "BIO_do_handshake with %s failed: %s", buf,
                         ERR_error_string(ERR_get_error(), NULL));
                     err_reply(cl, h503, lstn->err503);
-                    free_headers(headers);
                     clean_all();
                     return;
                 }
@@ -913,11 +1863,10 @@ do_http(thr_arg *arg)
             if((bb = BIO_new(BIO_f_buffer())) == NULL) {
                 logmsg(LOG_WARNING, "(%lx) e503 BIO_new(buffer) server failed", pthread_self());
                 err_reply(cl, h503, lstn->err503);
-                free_headers(headers);
                 clean_all();
                 return;
             }
-            BIO_set_buffer_size(bb, MAXBUF);
+            BIO_set_buffer_size(bb, lstn->buf_size);
             BIO_set_close(bb, BIO_CLOSE);
             be = BIO_push(bb, be);
         }
@@ -932,35 +1881,32 @@ do_http(thr_arg *arg)
 
         /* send the request */
         if(cur_backend->be_type == 0) {
-            for(n = 0; n < MAXHEADERS && headers[n]; n++) {
+            for(n = 0; n < headers->n; n++) {
                 if(!headers_ok[n])
                     continue;
                 /* this is the earliest we can check for Destination - we had no back-end before */
-                if(lstn->rewr_dest && check_header(headers[n], buf) == HEADER_DESTINATION) {
-                    if(regexec(&LOCATION, buf, 4, matches, 0)) {
-                        logmsg(LOG_NOTICE, "(%lx) Can't parse Destination %s", pthread_self(), buf);
+                if(lstn->rewr_dest && headers->type[n] == HEADER_DESTINATION) {
+                    if(regexec(&LOCATION, HDR_VAL(headers, n), 4, matches, 0)) {
+                        logmsg(LOG_NOTICE, "(%lx) Can't parse Destination %s", pthread_self(), HDR_VAL(headers, n));
                         break;
                     }
                     str_be(caddr, MAXBUF - 1, cur_backend);
-                    strcpy(loc_path, buf + matches[3].rm_so);
-                    snprintf(buf, MAXBUF, "Destination: http://%s%s", caddr, loc_path);
-                    free(headers[n]);
-                    if((headers[n] = strdup(buf)) == NULL) {
+                    strcpy(loc_path, HDR_VAL(headers, n) + matches[3].rm_so);
+                    snprintf(buf, BUF_SIZE(lstn), "Destination: http://%s%s", caddr, loc_path);
+                    if(hdr_replace(headers, n, buf)) {
                         logmsg(LOG_WARNING, "(%lx) rewrite Destination - out of memory: %s",
                             pthread_self(), strerror(errno));
-                        free_headers(headers);
                         clean_all();
                         return;
                     }
                 }
-                if(BIO_printf(be, "%s\r\n", headers[n]) <= 0) {
+                if(BIO_write(be, HDR(headers, n), headers->len[n]) != headers->len[n] || BIO_write(be, "\r\n", 2) != 2) {
                     str_be(buf, MAXBUF - 1, cur_backend);
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write to %s/%s: %s (%.3f sec)",
                         pthread_self(), buf, request, strerror(errno),
                         (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
-                    free_headers(headers);
+                    own_reply(h500, lstn->err500);
                     clean_all();
                     return;
                 }
@@ -972,13 +1918,11 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write AddHeader to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
-                    free_headers(headers);
+                    own_reply(h500, lstn->err500);
                     clean_all();
                     return;
                 }
         }
-        free_headers(headers);
 
         /* if SSL put additional headers for client certificate */
         if(cur_backend->be_type == 0 && ssl != NULL) {
@@ -992,7 +1936,7 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-cipher to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     clean_all();
                     return;
                 }
@@ -1006,7 +1950,7 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-Subject to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
@@ -1019,7 +1963,7 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-Issuer to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
@@ -1032,7 +1976,7 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-notBefore to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
@@ -1045,7 +1989,7 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-notAfter to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
@@ -1055,72 +1999,22 @@ do_http(thr_arg *arg)
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-serial to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
-                    BIO_free_all(bb);
-                    clean_all();
-                    return;
-                }
-#ifdef  CERT1L
-                PEM_write_bio_X509(bb, x509);
-                get_line(bb, buf, MAXBUF);
-                if(BIO_printf(be, "X-SSL-certificate: %s", buf) <= 0) {
-                    str_be(buf, MAXBUF - 1, cur_backend);
-                    end_req = cur_time();
-                    logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-certificate to %s: %s (%.3f sec)",
-                        pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
-                    BIO_free_all(bb);
-                    clean_all();
-                    return;
-                }
-                while(get_line(bb, buf, MAXBUF) == 0) {
-                    if(BIO_printf(be, "%s", buf) <= 0) {
-                        str_be(buf, MAXBUF - 1, cur_backend);
-                        end_req = cur_time();
-                        logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-certificate to %s: %s (%.3f sec)",
-                            pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                        err_reply(cl, h500, lstn->err500);
-                        BIO_free_all(bb);
-                        clean_all();
-                        return;
-                    }
-                }
-                if(BIO_printf(be, "\r\n", buf) <= 0) {
-                    str_be(buf, MAXBUF - 1, cur_backend);
-                    end_req = cur_time();
-                    logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-certificate to %s: %s (%.3f sec)",
-                        pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
                 }
-#else
                 PEM_write_bio_X509(bb, x509);
-                get_line(bb, buf, MAXBUF);
-                if(BIO_printf(be, "X-SSL-certificate: %s\r\n", buf) <= 0) {
+                if(put_pem(be, bb)) {
                     str_be(buf, MAXBUF - 1, cur_backend);
                     end_req = cur_time();
                     logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-certificate to %s: %s (%.3f sec)",
                         pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                    err_reply(cl, h500, lstn->err500);
+                    own_reply(h500, lstn->err500);
                     BIO_free_all(bb);
                     clean_all();
                     return;
                 }
-                while(get_line(bb, buf, MAXBUF) == 0) {
-                    if(BIO_printf(be, "\t%s\r\n", buf) <= 0) {
-                        str_be(buf, MAXBUF - 1, cur_backend);
-                        end_req = cur_time();
-                        logmsg(LOG_WARNING, "(%lx) e500 error write X-SSL-certificate to %s: %s (%.3f sec)",
-                            pthread_self(), buf, strerror(errno), (end_req - start_req) / 1000000.0);
-                        err_reply(cl, h500, lstn->err500);
-                        BIO_free_all(bb);
-                        clean_all();
-                        return;
-                    }
-                }
-#endif
                 BIO_free_all(bb);
             }
         }
@@ -1135,7 +2029,7 @@ do_http(thr_arg *arg)
 
         if(cl_11 && chunked) {
             /* had Transfer-encoding: chunked so read/write all the chunks (HTTP/1.1 only) */
-            if(copy_chunks(cl, be, NULL, cur_backend->be_type, lstn->max_req)) {
+            if(copy_chunks(cl, be, NULL, cur_backend->be_type, lstn->max_req, &conn->relay)) {
                 str_be(buf, MAXBUF - 1, cur_backend);
                 end_req = cur_time();
                 addr2str(caddr, MAXBUF - 1, &from_host, 1);
@@ -1147,7 +2041,7 @@ do_http(thr_arg *arg)
             }
         } else if(cont > L0 && is_rpc != 1) {
             /* had Content-length, so do raw reads/writes for the length */
-            if(copy_bin(cl, be, cont, NULL, cur_backend->be_type)) {
+            if(copy_bin(cl, be, cont, NULL, cur_backend->be_type, &conn->relay)) {
                 str_be(buf, MAXBUF - 1, cur_backend);
                 end_req = cur_time();
                 addr2str(caddr, MAXBUF - 1, &from_host, 1);
@@ -1158,83 +2052,27 @@ do_http(thr_arg *arg)
                 return;
             }
         } else if(cont > 0L && is_readable(cl, lstn->to)) {
-            char one;
-            BIO  *cl_unbuf;
             /*
              * special mode for RPC_IN_DATA - content until EOF
              * force HTTP/1.0 - client closes connection when done.
              */
-            cl_11 = be_11 = 0;
-
-            /*
-             * first read whatever is already in the input buffer
-             */
-            while(BIO_pending(cl)) {
-                if(BIO_read(cl, &one, 1) != 1) {
-                    logmsg(LOG_NOTICE, "(%lx) error read request pending: %s",
-                        pthread_self(), strerror(errno));
-                    clean_all();
-                    pthread_exit(NULL);
-                }
-                if (++res_bytes > cont) {
-                    logmsg(LOG_NOTICE, "(%lx) error read request pending: max. RPC length exceeded",
-                        pthread_self());
-                    clean_all();
-                    pthread_exit(NULL);
-                }
-                if(BIO_write(be, &one, 1) != 1) {
-                    if(errno)
-                        logmsg(LOG_NOTICE, "(%lx) error write request pending: %s",
-                            pthread_self(), strerror(errno));
-                    clean_all();
-                    pthread_exit(NULL);
-                }
-            }
-            BIO_flush(be);
-
-            /*
-             * find the socket BIO in the chain
-             */
-            if ((cl_unbuf = BIO_find_type(cl, lstn->ctx? BIO_TYPE_SSL : BIO_TYPE_SOCKET)) == NULL) {
-                 logmsg(LOG_WARNING, "(%lx) error get unbuffered: %s", pthread_self(), strerror(errno));
-                 clean_all();
-                 pthread_exit(NULL);
-            }
+            cl_11 = 0;
 
             /*
              * copy till EOF
              */
-            while((res = BIO_read(cl_unbuf, buf, MAXBUF)) > 0) {
-                if((res_bytes += res) > cont) {
+            if((res = copy_eof(cl, be, cont, &res_bytes, &conn->relay)) != 0) {
+                if(res == -5)
                     logmsg(LOG_NOTICE, "(%lx) error copy request body: max. RPC length exceeded",
                         pthread_self());
-                    clean_all();
-                    pthread_exit(NULL);
-                }
-                if(BIO_write(be, buf, res) != res) {
-                    if(errno)
-                        logmsg(LOG_NOTICE, "(%lx) error copy request body: %s",
-                            pthread_self(), strerror(errno));
-                    clean_all();
-                    pthread_exit(NULL);
-                } else {
-                    BIO_flush(be);
-                }
+                else if(errno)
+                    logmsg(LOG_NOTICE, "(%lx) error copy request body: %s",
+                        pthread_self(), strerror(errno));
+                clean_all();
+                return;
             }
         }
 
-        /* flush to the back-end */
-        if(cur_backend->be_type == 0 && BIO_flush(be) != 1) {
-            str_be(buf, MAXBUF - 1, cur_backend);
-            end_req = cur_time();
-            addr2str(caddr, MAXBUF - 1, &from_host, 1);
-            logmsg(LOG_NOTICE, "(%lx) e500 for %s error flush to %s/%s: %s (%.3f sec)",
-                pthread_self(), caddr, buf, request, strerror(errno), (end_req - start_req) / 1000000.0);
-            err_reply(cl, h500, lstn->err500);
-            clean_all();
-            return;
-        }
-
         /*
          * check on no_https_11:
          *  - if 0 ignore
@@ -1253,13 +2091,53 @@ do_http(thr_arg *arg)
             break;
         }
 
+        fwd.request = request;
+        fwd.v_host = v_host;
+        fwd.referer = referer;
+        fwd.u_agent = u_agent;
+        fwd.u_name = u_name;
+        fwd.req_time = req_time;
+        fwd.strs = NULL;
+        fwd.start_req = start_req;
+        fwd.svc = svc;
+        fwd.backend = cur_backend;
+        fwd.cl_11 = cl_11;
+        fwd.no_cont = no_cont;
+        fwd.is_rpc = is_rpc;
+        fwd.conn_closed = conn_closed;
+        fwd.force_10 = force_10;
+
+        /*
+         * the client pipelined its next request already: read it right away and forward it behind
+         * this one (see above) - but only as long as this one keeps the connection open
+         */
+        if(conn->n_ahead < lstn->pipeline && cur_backend->be_type == 0 && is_rpc < 0
+        && cl_11 && !conn_closed && !force_10 && next_request(cl, buf, BUF_SIZE(lstn), lstn)
+        && (conn->ahead != NULL || (conn->ahead = (FWD_REQ *)malloc(lstn->pipeline * sizeof(FWD_REQ))) != NULL)
+        && !keep_strs(&fwd)) {
+            conn->ahead[conn->n_ahead++] = fwd;
+            continue;
+        }
+
+        /* flush to the back-end */
+        if(cur_backend->be_type == 0 && BIO_flush(be) != 1) {
+            str_be(buf, MAXBUF - 1, cur_backend);
+            end_req = cur_time();
+            addr2str(caddr, MAXBUF - 1, &from_host, 1);
+            logmsg(LOG_NOTICE, "(%lx) e500 for %s error flush to %s/%s: %s (%.3f sec)",
+                pthread_self(), caddr, buf, request, strerror(errno), (end_req - start_req) / 1000000.0);
+            own_reply(h500, lstn->err500);
+            clean_all();
+            return;
+        }
+
         /* if we have a redirector */
         if(cur_backend->be_type) {
-            memset(buf, 0, sizeof(buf));
+            memset(buf, 0, BUF_SIZE(lstn));
             if(!cur_backend->redir_req)
-                snprintf(buf, sizeof(buf) - 1, "%s%s", cur_backend->url, url);
+                snprintf(buf, BUF_SIZE(lstn) - 1, "%s%s", cur_backend->url, url);
             else 
-                strncpy(buf, cur_backend->url, sizeof(buf) - 1);
+                strncpy(buf, cur_backend->url, BUF_SIZE(lstn) - 1);
             redirect_reply(cl, buf, cur_backend->be_type);
             addr2str(caddr, MAXBUF - 1, &from_host, 1);
             switch(lstn->log_level) {
@@ -1333,258 +2211,20 @@ do_http(thr_arg *arg)
             break;
         }
 
-        /* get the response */
-        for(skip = 1; skip;) {
-            if((headers = get_headers(be, cl, lstn)) == NULL) {
-                str_be(buf, MAXBUF - 1, cur_backend);
-                end_req = cur_time();
-                addr2str(caddr, MAXBUF - 1, &from_host, 1);
-                logmsg(LOG_NOTICE, "(%lx) e500 for %s response error read from %s/%s: %s (%.3f secs)",
-                    pthread_self(), caddr, buf, request, strerror(errno), (end_req - start_req) / 1000000.0);
-                err_reply(cl, h500, lstn->err500);
-                clean_all();
-                return;
-            }
-
-            strncpy(response, headers[0], MAXBUF);
-            be_11 = (response[7] == '1');
-            /* responses with code 100 are never passed back to the client */
-            skip = !regexec(&RESP_SKIP, response, 0, NULL, 0);
-            /* some response codes (1xx, 204, 304) have no content */
-            if(!no_cont && !regexec(&RESP_IGN, response, 0, NULL, 0))
-                no_cont = 1;
-
-            for(chunked = 0, cont = -1L, n = 1; n < MAXHEADERS && headers[n]; n++) {
-                switch(check_header(headers[n], buf)) {
-                case HEADER_CONNECTION:
-                    if(!strcasecmp("close", buf))
-                        conn_closed = 1;
-                    break;
-                case HEADER_TRANSFER_ENCODING:
-                    if(!strcasecmp("chunked", buf)) {
-                        chunked = 1;
-                        no_cont = 0;
-                    }
-                    break;
-                case HEADER_CONTENT_LENGTH:
-                    cont = ATOL(buf);
-                    /* treat RPC_OUT_DATA like reply without content-length */
-                    if(is_rpc == 0 && cont == 0x40000000L)
-                        cont = -1L;
-                    break;
-                case HEADER_LOCATION:
-                    if(v_host[0] && need_rewrite(lstn->rewr_loc, buf, loc_path, v_host, lstn, cur_backend)) {
-                        snprintf(buf, MAXBUF, "Location: %s://%s/%s",
-                            (ssl == NULL? "http": "https"), v_host, loc_path);
-                        free(headers[n]);
-                        if((headers[n] = strdup(buf)) == NULL) {
-                            logmsg(LOG_WARNING, "(%lx) rewrite Location - out of memory: %s",
-                                pthread_self(), strerror(errno));
-                            free_headers(headers);
-                            clean_all();
-                            return;
-                        }
-                    }
-                    break;
-                case HEADER_CONTLOCATION:
-                    if(v_host[0] && need_rewrite(lstn->rewr_loc, buf, loc_path, v_host, lstn, cur_backend)) {
-                        snprintf(buf, MAXBUF, "Content-location: %s://%s/%s",
-                            (ssl == NULL? "http": "https"), v_host, loc_path);
-                        free(headers[n]);
-                        if((headers[n] = strdup(buf)) == NULL) {
-                            logmsg(LOG_WARNING, "(%lx) rewrite Content-location - out of memory: %s",
-                                pthread_self(), strerror(errno));
-                            free_headers(headers);
-                            clean_all();
-                            return;
-                        }
-                    }
-                    break;
-                }
-            }
-
-            /* possibly record session information (only for cookies/header) */
-            upd_session(svc, &headers[1], cur_backend);
-
-            /* send the response */
-            if(!skip)
-                for(n = 0; n < MAXHEADERS && headers[n]; n++) {
-                    if(BIO_printf(cl, "%s\r\n", headers[n]) <= 0) {
-                        if(errno) {
-                            addr2str(caddr, MAXBUF - 1, &from_host, 1);
-                            logmsg(LOG_NOTICE, "(%lx) error write to %s: %s", pthread_self(), caddr, strerror(errno));
-                        }
-                        free_headers(headers);
-                        clean_all();
-                        return;
-                    }
-                }
-            free_headers(headers);
-
-            /* final CRLF */
-            if(!skip)
-                BIO_puts(cl, "\r\n");
-            if(BIO_flush(cl) != 1) {
-                if(errno) {
-                    addr2str(caddr, MAXBUF - 1, &from_host, 1);
-                    logmsg(LOG_NOTICE, "(%lx) error flush headers to %s: %s", pthread_self(), caddr, strerror(errno));
-                }
-                clean_all();
-                return;
-            }
-
-            if(!no_cont) {
-                /* ignore this if request was HEAD or similar */
-                if(be_11 && chunked) {
-                    /* had Transfer-encoding: chunked so read/write all the chunks (HTTP/1.1 only) */
-                    if(copy_chunks(be, cl, &res_bytes, skip, L0)) {
-                        /* copy_chunks() has its own error messages */
-                        clean_all();
-                        return;
-                    }
-                } else if(cont >= L0) {
-                    /* may have had Content-length, so do raw reads/writes for the length */
-                    if(copy_bin(be, cl, cont, &res_bytes, skip)) {
-                        if(errno)
-                            logmsg(LOG_NOTICE, "(%lx) error copy server cont: %s", pthread_self(), strerror(errno));
-                        clean_all();
-                        return;
-                    }
-                } else if(!skip) {
-                    if(is_readable(be, cur_backend->to)) {
-                        char    one;
-                        BIO     *be_unbuf;
-                        /*
-                         * old-style response - content until EOF
-                         * also implies the client may not use HTTP/1.1
-                         */
-                        cl_11 = be_11 = 0;
-
-                        /*
-                         * first read whatever is already in the input buffer
-                         */
-                        while(BIO_pending(be)) {
-                            if(BIO_read(be, &one, 1) != 1) {
-                                logmsg(LOG_NOTICE, "(%lx) error read response pending: %s",
-                                    pthread_self(), strerror(errno));
-                                clean_all();
-                                return;
-                            }
-                            if(BIO_write(cl, &one, 1) != 1) {
-                                if(errno)
-                                    logmsg(LOG_NOTICE, "(%lx) error write response pending: %s",
-                                        pthread_self(), strerror(errno));
-                                clean_all();
-                                return;
-                            }
-                            res_bytes++;
-                        }
-                        BIO_flush(cl);
-
-                        /*
-                         * find the socket BIO in the chain
-                         */
-                        if((be_unbuf = BIO_find_type(be, cur_backend->ctx? BIO_TYPE_SSL : BIO_TYPE_SOCKET)) == NULL) {
-                            logmsg(LOG_WARNING, "(%lx) error get unbuffered: %s", pthread_self(), strerror(errno));
-                            clean_all();
-                            return;
-                        }
-
-                        /*
-                         * copy till EOF
-                         */
-                        while((res = BIO_read(be_unbuf, buf, MAXBUF)) > 0) {
-                            if(BIO_write(cl, buf, res) != res) {
-                                if(errno)
-                                    logmsg(LOG_NOTICE, "(%lx) error copy response body: %s",
-                                        pthread_self(), strerror(errno));
-                                clean_all();
-                                return;
-                            } else {
-                                res_bytes += res;
-                                BIO_flush(cl);
-                            }
-                        }
-                    }
-                }
-                if(BIO_flush(cl) != 1) {
-                    /* client closes RPC_OUT_DATA connection - no error */
-                    if(is_rpc == 0 && res_bytes > 0L)
-                        break;
-                    if(errno) {
-                        addr2str(caddr, MAXBUF - 1, &from_host, 1);
-                        logmsg(LOG_NOTICE, "(%lx) error final flush to %s: %s", pthread_self(), caddr, strerror(errno));
-                    }
-                    clean_all();
-                    return;
-                }
-            }
-        }
-        end_req = cur_time();
-        upd_be(svc, cur_backend, end_req - start_req);
-
-        /* log what happened */
-        memset(s_res_bytes, 0, LOG_BYTES_SIZE);
-        log_bytes(s_res_bytes, res_bytes);
-        addr2str(caddr, MAXBUF - 1, &from_host, 1);
-        if(anonymise) {
-            char    *last;
-
-            if((last = strrchr(caddr, '.')) != NULL || (last = strrchr(caddr, ':')) != NULL)
-                strcpy(++last, "0");
-        }
-        str_be(buf, MAXBUF - 1, cur_backend);
-        switch(lstn->log_level) {
-        case 0:
-            break;
-        case 1:
-            logmsg(LOG_INFO, "%s %s - %s", caddr, request, response);
-            break;
-        case 2:
-            if(v_host[0])
-                logmsg(LOG_INFO, "%s %s - %s (%s/%s -> %s) %.3f sec",
-                    caddr, request, response, v_host, svc->name[0]? svc->name: "-", buf,
-                    (end_req - start_req) / 1000000.0);
-            else
-                logmsg(LOG_INFO, "%s %s - %s (%s -> %s) %.3f sec",
-                    caddr, request, response, svc->name[0]? svc->name: "-", buf,
-                    (end_req - start_req) / 1000000.0);
-            break;
-        case 3:
-            logmsg(LOG_INFO, "%s %s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\"",
-                v_host[0]? v_host: "-",
-                caddr, u_name[0]? u_name: "-", req_time, request, response[9],
-                response[10], response[11], s_res_bytes, referer, u_agent);
-            break;
-        case 4:
-            logmsg(LOG_INFO, "%s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\"",
-                caddr, u_name[0]? u_name: "-", req_time, request, response[9], response[10],
-                response[11], s_res_bytes, referer, u_agent);
-            break;
-        case 5:
-            logmsg(LOG_INFO, "%s %s - %s [%s] \"%s\" %c%c%c %s \"%s\" \"%s\" (%s -> %s) %.3f sec",
-                v_host[0]? v_host: "-",
-                caddr, u_name[0]? u_name: "-", req_time, request, response[9], response[10],
-                response[11], s_res_bytes, referer, u_agent, svc->name[0]? svc->name: "-", buf,
-                (end_req - start_req) / 1000000.0);
-            break;
+        /* the responses go back in the order of the requests */
+        if((res = drain_ahead(arg, conn, cl, &be, &from_host, loc_path, buf)) == 0) {
+            if(be == NULL)
+                /* the back-end went away before it answered this one */
+                break;
+            res = relay_response(arg, conn, cl, &be, &fwd, &from_host, loc_path, buf);
         }
-
-        if(!be_11) {
-            BIO_reset(be);
-            BIO_free_all(be);
-            be = NULL;
+        if(res < 0) {
+            clean_all();
+            return;
         }
-        /*
-         * Stop processing if:
-         *  - client is not HTTP/1.1
-         *      or
-         *  - we had a "Connection: closed" header
-         *      or
-         *  - this is an SSL connection and we had a NoHTTPS11 directive
-         */
-        if(!cl_11 || conn_closed || force_10)
+        if(res > 0)
             break;
+        may_park = park_keepalive;
     }
 
     /*
@@ -1597,14 +2237,79 @@ do_http(thr_arg *arg)
     return;
 }
 
-void *
-thr_http(void *dummy)
+/*
+ * handle an HTTP connection - to the end, or until it is parked (arg->conn then set)
+ */
+void
+do_http(thr_arg *arg)
+{
+    HTTP_CONN   conn_local, *conn;
+
+    if((conn = arg->conn) == NULL) {
+        if(!park_keepalive)
+            conn = &conn_local;
+        else if((conn = (HTTP_CONN *)malloc(sizeof(HTTP_CONN))) == NULL) {
+            logmsg(LOG_WARNING, "(%lx) HTTP_CONN malloc failed", pthread_self());
+            shutdown(arg->sock, 2);
+            close(arg->sock);
+            return;
+        }
+        memset(conn, 0, sizeof(HTTP_CONN));
+        if(open_client(arg, conn)) {
+            if(conn != &conn_local)
+                free(conn);
+            return;
+        }
+    }
+    serve_client(arg, conn);
+    if(arg->conn == conn)
+        /* parked - it is no longer ours */
+        return;
+    free_conn(conn);
+    if(conn != &conn_local)
+        free(conn);
+    return;
+}
+
+/*
+ * close a parked keep-alive connection and release its services
+ */
+void
+http_drop(thr_arg *arg)
 {
-    thr_arg *arg;
+    HTTP_CONN   *conn;
+    BIO         *cl, *be;
+    SSL         *ssl;
+    X509        *x509;
+
+    conn = arg->conn;
+    cl = conn->cl;
+    be = conn->be;
+    ssl = conn->ssl;
+    x509 = conn->x509;
+    if(ssl != NULL)
+        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    clean_all();
+    free_conn(conn);
+    free(conn);
+    arg->conn = NULL;
+    put_svc_conf(arg->conf);
+    return;
+}
 
-    for(;;) {
-        while((arg = get_thr_arg()) == NULL)
-            logmsg(LOG_WARNING, "NULL get_thr_arg");
-        do_http(arg);
+void *
+thr_http(void *lstn)
+{
+    thr_arg arg;
+
+    set_affinity(AFF_WORKER);
+    while(get_thr_arg((LISTENER *)lstn, &arg) == 0) {
+        /* the connection keeps the services it started with, even across a reload (or while parked) */
+        if(arg.conn == NULL)
+            arg.conf = get_svc_conf();
+        do_http(&arg);
+        if(arg.conn == NULL)
+            put_svc_conf(arg.conf);
     }
+    return NULL;
 }
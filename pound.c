@@ -46,11 +46,7 @@ SERVICE     *services;          /* global services (if any) */
 
 LISTENER    *listeners;         /* all available listeners */
 
-regex_t HEADER,             /* Allowed header */
-        CHUNK_HEAD,         /* chunk header line */
-        RESP_SKIP,          /* responses for which we skip response */
-        RESP_IGN,           /* responses for which we ignore content */
-        LOCATION,           /* the host we are redirected to */
+regex_t LOCATION,           /* the host we are redirected to */
         AUTHORIZATION;      /* the Authorisation header */
 
 static int  shut_down = 0;
@@ -60,8 +56,9 @@ static int  shut_down = 0;
 int     SOL_TCP;
 #endif
 
-/* worker pid */
-static  pid_t               son = 0;
+/* worker pids (in the monitor only) */
+static  pid_t               *sons = NULL;
+int                         n_workers;          /* number of worker processes */
 
 /*
  * OpenSSL thread support stuff
@@ -105,92 +102,1690 @@ l_id(void)
     return (unsigned long)pthread_self();
 }
 
+/*
+ * current time in milliseconds
+ */
+static double
+now_ms(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
 /*
  * work queue stuff
+ *
+ * A queue is a bounded ring of ARG_QUEUE slots (Vyukov's MPMC queue): each slot carries a
+ * sequence number telling producers and consumers whose turn it is, so neither side needs
+ * a lock and no memory is allocated per connection. Idle workers sleep on a futex (or on a
+ * condition variable where there is none); producers only wake them if somebody is asleep.
+ *
+ * There is one shared queue plus one for each listener with a Weight or ReservedThreads of
+ * its own. The shared workers serve all queues, in a weighted round-robin; the reserved
+ * workers of a listener serve only its queue, and get woken first for its requests.
+ *
+ * The pool of shared workers is elastic: it starts with min_threads, a put that finds more
+ * requests queued than idle workers starts a new one (up to max_threads) and workers idle for
+ * more than idle_to seconds exit again (down to min_threads).
+ */
+typedef struct {
+    volatile unsigned long  seq;
+    thr_arg                 arg;
+}   ARG_SLOT;
+
+typedef struct _work_queue {
+    ARG_SLOT                *ring;
+    volatile unsigned long  head,       /* next slot to dequeue */
+                            tail;       /* next slot to enqueue */
+    volatile int            event,      /* bumped on each put - the futex word of the reserved workers */
+                            sleepers;   /* reserved workers asleep */
+#if !HAVE_LINUX_FUTEX_H
+    pthread_cond_t          cond;
+#endif
+}   WORK_QUEUE;
+
+static WORK_QUEUE               **queues;       /* queues[0] is the shared queue */
+static int                      n_queues;
+static int                      *arg_sched, n_sched;    /* weighted round-robin schedule */
+static volatile unsigned long   arg_turn = 0;
+static volatile int             arg_event = 0,  /* bumped on each put - the futex word of the shared workers */
+                                arg_sleepers = 0,
+                                thr_count = 0,  /* number of running shared workers */
+                                thr_reserved = 0;
+#if !HAVE_LINUX_FUTEX_H
+static pthread_cond_t           arg_cond;
+static pthread_mutex_t          arg_mut;
+#endif
+static pthread_attr_t           thr_attr;
+int                             numthreads, min_threads, max_threads, idle_to;
+
+static WORK_QUEUE *
+new_queue(void)
+{
+    WORK_QUEUE      *res;
+    unsigned long   i;
+
+    if((res = (WORK_QUEUE *)calloc(1, sizeof(WORK_QUEUE))) == NULL
+    || (res->ring = (ARG_SLOT *)calloc(ARG_QUEUE, sizeof(ARG_SLOT))) == NULL) {
+        logmsg(LOG_ERR, "work queue: out of memory - aborted");
+        exit(1);
+    }
+    for(i = 0; i < ARG_QUEUE; i++)
+        res->ring[i].seq = i;
+#if !HAVE_LINUX_FUTEX_H
+    pthread_cond_init(&res->cond, NULL);
+#endif
+    return res;
+}
+
+/*
+ * set up the queues - must run after the configuration was parsed
+ */
+static void
+init_thr_arg(void)
+{
+    LISTENER    *lstn;
+    int         i, n, *cur, best;
+
+    for(n_queues = 1, lstn = listeners; lstn; lstn = lstn->next)
+        if(lstn->weight > 0)
+            n_queues++;
+    if((queues = (WORK_QUEUE **)calloc(n_queues, sizeof(WORK_QUEUE *))) == NULL
+    || (cur = (int *)calloc(n_queues, sizeof(int))) == NULL) {
+        logmsg(LOG_ERR, "work queue: out of memory - aborted");
+        exit(1);
+    }
+    queues[0] = new_queue();
+    for(n_sched = 1, i = 1, lstn = listeners; lstn; lstn = lstn->next)
+        if(lstn->weight > 0) {
+            queues[i++] = lstn->queue = new_queue();
+            n_sched += lstn->weight;
+        }
+
+    /* smooth weighted round-robin: the shared queue has a weight of 1 */
+    if((arg_sched = (int *)calloc(n_sched, sizeof(int))) == NULL) {
+        logmsg(LOG_ERR, "work queue: out of memory - aborted");
+        exit(1);
+    }
+    for(n = 0; n < n_sched; n++) {
+        for(best = 0, i = 0, lstn = listeners; i < n_queues; i++) {
+            if(i > 0) {
+                while(lstn->weight <= 0)
+                    lstn = lstn->next;
+                cur[i] += lstn->weight;
+                lstn = lstn->next;
+            } else
+                cur[i] += 1;
+            if(cur[i] > cur[best])
+                best = i;
+        }
+        cur[best] -= n_sched;
+        arg_sched[n] = best;
+    }
+    free(cur);
+
+#if !HAVE_LINUX_FUTEX_H
+    pthread_cond_init(&arg_cond, NULL);
+    pthread_mutex_init(&arg_mut, NULL);
+#endif
+    pthread_attr_init(&thr_attr);
+    pthread_attr_setdetachstate(&thr_attr, PTHREAD_CREATE_DETACHED);
+#ifdef  NEED_STACK
+    /* set new stack size - necessary for OpenBSD/FreeBSD and Linux NPTL */
+    if(pthread_attr_setstacksize(&thr_attr, 1 << 18)) {
+        logmsg(LOG_ERR, "can't set stack size - aborted");
+        exit(1);
+    }
+#endif
+    return;
+}
+
+/*
+ * sleep until *event changes from ev - return 1 if nothing happened for idle_to seconds
+ */
+#if HAVE_LINUX_FUTEX_H
+static int
+arg_park(volatile int *event, const int ev, const int timed)
+{
+    struct timespec to;
+
+    to.tv_sec = idle_to;
+    to.tv_nsec = 0;
+    return syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, ev, timed? &to: NULL, NULL, 0) < 0 && errno == ETIMEDOUT;
+}
+#else
+static int
+arg_park(volatile int *event, const int ev, const int timed, pthread_cond_t *cond)
+{
+    struct timespec to;
+    int             res;
+
+    res = 0;
+    (void)pthread_mutex_lock(&arg_mut);
+    if(*event == ev) {
+        if(timed) {
+            to.tv_sec = time(NULL) + idle_to;
+            to.tv_nsec = 0;
+            res = pthread_cond_timedwait(cond, &arg_mut, &to) == ETIMEDOUT;
+        } else
+            (void)pthread_cond_wait(cond, &arg_mut);
+    }
+    (void)pthread_mutex_unlock(&arg_mut);
+    return res;
+}
+#endif
+
+/*
+ * wake up one worker sleeping on event (if any)
+ */
+#if HAVE_LINUX_FUTEX_H
+static void
+arg_unpark(volatile int *event)
+{
+    syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    return;
+}
+#else
+static void
+arg_unpark(pthread_cond_t *cond)
+{
+    (void)pthread_mutex_lock(&arg_mut);
+    pthread_cond_signal(cond);
+    (void)pthread_mutex_unlock(&arg_mut);
+    return;
+}
+#endif
+
+/*
+ * there is work in q: wake one of its reserved workers or else one of the shared ones
+ */
+static void
+arg_wake(WORK_QUEUE *q)
+{
+    __sync_fetch_and_add(&q->event, 1);
+    if(q->sleepers > 0) {
+#if HAVE_LINUX_FUTEX_H
+        arg_unpark(&q->event);
+#else
+        arg_unpark(&q->cond);
+#endif
+        return;
+    }
+    __sync_fetch_and_add(&arg_event, 1);
+    if(arg_sleepers > 0)
+#if HAVE_LINUX_FUTEX_H
+        arg_unpark(&arg_event);
+#else
+        arg_unpark(&arg_cond);
+#endif
+    return;
+}
+
+/*
+ * try to take a request off q - return 0 on success, -1 if empty
+ */
+static int
+q_get(WORK_QUEUE *q, thr_arg *arg)
+{
+    ARG_SLOT        *slot;
+    unsigned long   pos;
+    long            dif;
+
+    for(pos = q->head;;) {
+        slot = &q->ring[pos & (ARG_QUEUE - 1)];
+        if((dif = (long)(slot->seq - (pos + 1))) == 0) {
+            if(__sync_bool_compare_and_swap(&q->head, pos, pos + 1))
+                break;
+            pos = q->head;
+        } else if(dif < 0)
+            return -1;
+        else
+            pos = q->head;
+    }
+    memcpy(arg, &slot->arg, sizeof(thr_arg));
+    __sync_synchronize();
+    slot->seq = pos + ARG_QUEUE;
+    /* pass a wake-up on while there is more to do */
+    if(q->tail != q->head)
+        arg_wake(q);
+    return 0;
+}
+
+/*
+ * try to take a request off any queue, weighted round-robin - return 0 on success, -1 if all are empty
+ */
+static int
+try_thr_arg(thr_arg *arg)
+{
+    int i, start;
+
+    if(n_queues == 1)
+        return q_get(queues[0], arg);
+    start = arg_sched[__sync_fetch_and_add(&arg_turn, 1) % n_sched];
+    for(i = 0; i < n_queues; i++)
+        if(q_get(queues[(start + i) % n_queues], arg) == 0)
+            return 0;
+    return -1;
+}
+
+/*
+ * add a request to the queue
+ */
+int
+put_thr_arg(thr_arg *arg)
+{
+    WORK_QUEUE      *q;
+    ARG_SLOT        *slot;
+    unsigned long   pos;
+    long            dif;
+
+    if(arg->lstn->max_queue > 0 && arg->lstn->n_queued >= arg->lstn->max_queue)
+        return -1;
+    if(arg->lstn->max_wait > 0)
+        arg->queued = now_ms();
+    q = arg->lstn->queue? arg->lstn->queue: queues[0];
+    for(pos = q->tail;;) {
+        slot = &q->ring[pos & (ARG_QUEUE - 1)];
+        if((dif = (long)(slot->seq - pos)) == 0) {
+            if(__sync_bool_compare_and_swap(&q->tail, pos, pos + 1))
+                break;
+            pos = q->tail;
+        } else if(dif < 0) {
+            logmsg(LOG_WARNING, "put_thr_arg: queue full");
+            return -1;
+        } else
+            pos = q->tail;
+    }
+    __sync_fetch_and_add(&arg->lstn->n_queued, 1);
+    memcpy(&slot->arg, arg, sizeof(thr_arg));
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    arg_wake(q);
+    /* more work waiting than idle workers to do it: grow the pool */
+    if(thr_count < max_threads && get_thr_qlen() > arg_sleepers + (q == queues[0]? 0: q->sleepers))
+        (void)new_worker();
+    return 0;
+}
+
+/*
+ * wait for a request - see get_thr_arg()
+ */
+static int
+take_thr_arg(LISTENER *lstn, thr_arg *arg)
+{
+    WORK_QUEUE  *q;
+    int         ev, n;
+
+    if(lstn != NULL) {
+        /* a put after our attempt changed the event, so we do not sleep through it */
+        for(q = lstn->queue;;) {
+            ev = __sync_fetch_and_add(&q->event, 0);
+            if(q_get(q, arg) == 0)
+                return 0;
+            __sync_fetch_and_add(&q->sleepers, 1);
+#if HAVE_LINUX_FUTEX_H
+            (void)arg_park(&q->event, ev, 0);
+#else
+            (void)arg_park(&q->event, ev, 0, &q->cond);
+#endif
+            __sync_fetch_and_sub(&q->sleepers, 1);
+        }
+    }
+    for(;;) {
+        ev = __sync_fetch_and_add(&arg_event, 0);
+        if(try_thr_arg(arg) == 0)
+            return 0;
+        __sync_fetch_and_add(&arg_sleepers, 1);
+#if HAVE_LINUX_FUTEX_H
+        if(arg_park(&arg_event, ev, min_threads < max_threads)) {
+#else
+        if(arg_park(&arg_event, ev, min_threads < max_threads, &arg_cond)) {
+#endif
+            __sync_fetch_and_sub(&arg_sleepers, 1);
+            /* a wake-up meant for us may have come just as we timed out - look once more before leaving */
+            if(try_thr_arg(arg) == 0)
+                return 0;
+            if((n = thr_count) > min_threads && __sync_bool_compare_and_swap(&thr_count, n, n - 1))
+                return -1;
+            continue;
+        }
+        __sync_fetch_and_sub(&arg_sleepers, 1);
+    }
+}
+
+/*
+ * get a request from the queue - wait for one if necessary
+ *
+ * lstn is the listener the calling worker is reserved for (NULL for the shared workers).
+ * Requests that waited longer than their listener allows are answered with a 503 here.
+ * Returns -1 if the worker was idle for too long and should exit.
+ */
+int
+get_thr_arg(LISTENER *lstn, thr_arg *arg)
+{
+    for(;;) {
+        if(take_thr_arg(lstn, arg))
+            return -1;
+        __sync_fetch_and_sub(&arg->lstn->n_queued, 1);
+        if(arg->lstn->max_wait > 0 && now_ms() - arg->queued > arg->lstn->max_wait) {
+            reject_conn(arg);
+            continue;
+        }
+        return 0;
+    }
+}
+
+/*
+ * get the current queue length
+ */
+int
+get_thr_qlen(void)
+{
+    long    res;
+    int     i;
+
+    for(res = 0, i = 0; i < n_queues; i++)
+        res += (long)(queues[i]->tail - queues[i]->head);
+    return res < 0? 0: (int)res;
+}
+
+/*
+ * get the current number of worker threads (all/idle)
+ */
+int
+get_thr_count(void)
+{
+    return thr_count + thr_reserved;
+}
+
+int
+get_thr_idle(void)
+{
+    int i, res;
+
+    for(res = arg_sleepers, i = 1; i < n_queues; i++)
+        res += queues[i]->sleepers;
+    return res;
+}
+
+/*
+ * start a new worker thread (unless there are max_threads already)
+ */
+int
+new_worker(void)
+{
+    pthread_t   thr;
+    int         n, res;
+
+    do {
+        if((n = thr_count) >= max_threads)
+            return 0;
+    } while(!__sync_bool_compare_and_swap(&thr_count, n, n + 1));
+    if((res = pthread_create(&thr, &thr_attr, thr_http, NULL)) != 0) {
+        __sync_fetch_and_sub(&thr_count, 1);
+        logmsg(LOG_WARNING, "create thr_http: %s", strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * start the worker threads reserved for lstn
+ */
+static void
+new_reserved(LISTENER *lstn)
+{
+    pthread_t   thr;
+    int         i, res;
+
+    for(i = 0; i < lstn->reserved; i++) {
+        if((res = pthread_create(&thr, &thr_attr, thr_http, lstn)) != 0) {
+            logmsg(LOG_ERR, "create thr_http: %s - aborted", strerror(res));
+            exit(1);
+        }
+        __sync_fetch_and_add(&thr_reserved, 1);
+    }
+    return;
+}
+
+/*
+ * event engine stuff
+ *
+ * Connections that wait for the client to send something are kept in an (edge-triggered)
+ * epoll set by a small number of event threads instead of occupying a worker thread.
+ * Once the socket becomes readable the connection is put on the work queue.
+ *
+ * With ParkKeepAlive this applies between the requests of a keep-alive connection as well:
+ * the worker parks it here with its state (arg->conn) once the response is out.
+ */
+int                     evt_threads;
+int                     park_keepalive;
+
+#if HAVE_SYS_EPOLL_H
+
+#define EVT_BATCH   64
+
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP  0
+#endif
+
+typedef struct _evt_node {
+    thr_arg             arg;
+    time_t              expire;     /* give up on the client after this */
+    struct _evt_node    *prev, *next;
+}   EVT_NODE;
+
+typedef struct  {
+    int                 efd;        /* epoll descriptor */
+    pthread_mutex_t     mut;        /* protects the list */
+    EVT_NODE            *first;     /* connections waiting in this loop */
+}   EVT_LOOP;
+
+static EVT_LOOP         *evt_loops = NULL;
+static unsigned int     evt_next = 0;
+
+static void
+evt_unlink(EVT_LOOP *const loop, EVT_NODE *const node)
+{
+    if(node->prev)
+        node->prev->next = node->next;
+    else
+        loop->first = node->next;
+    if(node->next)
+        node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    return;
+}
+
+static void
+evt_drop(EVT_NODE *const node)
+{
+    if(node->arg.conn != NULL)
+        http_drop(&node->arg);
+    else {
+        shutdown(node->arg.sock, 2);
+        close(node->arg.sock);
+    }
+    free(node);
+    return;
+}
+
+/*
+ * hand a connection to the event engine: it is queued for the workers once readable
+ */
+int
+evt_add(thr_arg *arg)
+{
+    EVT_NODE            *node;
+    EVT_LOOP            *loop;
+    struct epoll_event  ev;
+    int                 res;
+
+    if((node = (EVT_NODE *)malloc(sizeof(EVT_NODE))) == NULL) {
+        logmsg(LOG_WARNING, "evt_add() malloc");
+        return -1;
+    }
+    memcpy(&node->arg, arg, sizeof(thr_arg));
+    node->expire = time(NULL) + arg->lstn->to;
+    node->prev = NULL;
+    loop = &evt_loops[__sync_fetch_and_add(&evt_next, 1) % evt_threads];
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = node;
+    /* the loop may fire as soon as the descriptor is added - keep it locked out until the node is linked */
+    (void)pthread_mutex_lock(&loop->mut);
+    if((res = epoll_ctl(loop->efd, EPOLL_CTL_ADD, arg->sock, &ev)) == 0) {
+        if((node->next = loop->first) != NULL)
+            node->next->prev = node;
+        loop->first = node;
+    }
+    (void)pthread_mutex_unlock(&loop->mut);
+    if(res) {
+        logmsg(LOG_WARNING, "evt_add() epoll_ctl: %s", strerror(errno));
+        free(node);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * event thread: wait for the connections to become readable and dispatch them to the workers
+ */
+static void *
+thr_evt(void *arg)
+{
+    EVT_LOOP            *loop;
+    EVT_NODE            *node, *next;
+    struct epoll_event  events[EVT_BATCH];
+    time_t              now, last_sweep;
+    int                 i, n;
+
+    set_affinity(AFF_ACCEPT);
+    loop = (EVT_LOOP *)arg;
+    for(last_sweep = time(NULL);;) {
+        if((n = epoll_wait(loop->efd, events, EVT_BATCH, 1000)) < 0) {
+            if(errno != EINTR)
+                logmsg(LOG_WARNING, "thr_evt() epoll_wait: %s", strerror(errno));
+            n = 0;
+        }
+        for(i = 0; i < n; i++) {
+            node = (EVT_NODE *)events[i].data.ptr;
+            (void)pthread_mutex_lock(&loop->mut);
+            evt_unlink(loop, node);
+            (void)pthread_mutex_unlock(&loop->mut);
+            epoll_ctl(loop->efd, EPOLL_CTL_DEL, node->arg.sock, NULL);
+            if(!(events[i].events & EPOLLIN) && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                /* client went away without sending anything */
+                evt_drop(node);
+                continue;
+            }
+            if(put_thr_arg(&node->arg))
+                reject_conn(&node->arg);
+            free(node);
+        }
+
+        /* expire the clients that sent nothing for too long */
+        if((now = time(NULL)) == last_sweep)
+            continue;
+        last_sweep = now;
+        (void)pthread_mutex_lock(&loop->mut);
+        for(node = loop->first; node; node = next) {
+            next = node->next;
+            if(node->expire > now)
+                continue;
+            evt_unlink(loop, node);
+            epoll_ctl(loop->efd, EPOLL_CTL_DEL, node->arg.sock, NULL);
+            evt_drop(node);
+        }
+        (void)pthread_mutex_unlock(&loop->mut);
+    }
+    return NULL;
+}
+
+/*
+ * start the event engine threads
+ */
+void
+evt_init(void)
+{
+    pthread_t       thr;
+    pthread_attr_t  attr;
+    int             i;
+
+    if((evt_loops = (EVT_LOOP *)calloc(evt_threads, sizeof(EVT_LOOP))) == NULL) {
+        logmsg(LOG_ERR, "evt_init: out of memory - aborted");
+        exit(1);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i = 0; i < evt_threads; i++) {
+        if((evt_loops[i].efd = epoll_create(EVT_BATCH)) < 0) {
+            logmsg(LOG_ERR, "evt_init epoll_create: %s - aborted", strerror(errno));
+            exit(1);
+        }
+        pthread_mutex_init(&evt_loops[i].mut, NULL);
+        if(pthread_create(&thr, &attr, thr_evt, &evt_loops[i])) {
+            logmsg(LOG_ERR, "create thr_evt: %s - aborted", strerror(errno));
+            exit(1);
+        }
+    }
+    return;
+}
+
+#else
+
+int
+evt_add(thr_arg *arg)
+{
+    return put_thr_arg(arg);
+}
+
+void
+evt_init(void)
+{
+    return;
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
+
+/*
+ * fiber stuff
+ *
+ * With Fibers N every connection runs as a fiber - its own stack and context in user space -
+ * on one of N scheduler threads instead of on a worker thread. Wherever a worker would block
+ * in poll() for the client or the back-end, the fiber registers the descriptor with the epoll
+ * set of its scheduler and switches back to it; the scheduler meanwhile resumes the fibers
+ * whose descriptors are ready. A connection waiting on keep-alive thus costs a stack rather
+ * than a thread. swapcontext() saves and restores the signal mask, i.e. costs a sigprocmask()
+ * system call each way - still far below a thread context switch.
+ */
+int                     fiber_threads;
+
+#ifdef  FIBERS
+
+#define FIBER_STACK (1 << 19)   /* virtual - only the pages actually used become resident */
+#define FIBER_CACHE 64          /* stacks kept for reuse by each scheduler */
+
+typedef struct _fiber {
+    ucontext_t          ctx;
+    thr_arg             arg;
+    struct _sched       *sched;
+    char                *stack;     /* lowest page is the guard */
+    struct pollfd       *wait;      /* what the fiber waits for (NULL: running or done) */
+    time_t              expire;     /* give up waiting after this (0: never) */
+    int                 res;        /* poll() result to return to the fiber */
+    struct _fiber       *prev, *next;
+}   FIBER;
+
+typedef struct _sched {
+    int                 efd;        /* epoll descriptor */
+    int                 wake[2];    /* pipe signalling new connections */
+    pthread_mutex_t     mut;        /* protects fresh */
+    FIBER               *fresh;     /* connections handed over by the acceptors */
+    FIBER               *waiting;   /* fibers registered in the epoll set */
+    char                *stacks[FIBER_CACHE];
+    int                 n_stacks;
+    int                 count;      /* fibers alive on this scheduler */
+    ucontext_t          ctx;        /* the scheduler loop while a fiber runs */
+}   SCHED;
+
+static SCHED            *scheds = NULL;
+static pthread_key_t    cur_fiber;
+static size_t           page_size;
+
+static void
+fiber_unlink(SCHED *const sched, FIBER *const fiber)
+{
+    if(fiber->prev)
+        fiber->prev->next = fiber->next;
+    else
+        sched->waiting = fiber->next;
+    if(fiber->next)
+        fiber->next->prev = fiber->prev;
+    fiber->prev = fiber->next = NULL;
+    return;
+}
+
+/*
+ * hand a connection to the least loaded fiber scheduler
+ */
+int
+fiber_add(thr_arg *arg)
+{
+    SCHED   *sched;
+    FIBER   *fiber;
+    int     i, first;
+
+    for(sched = &scheds[0], i = 1; i < fiber_threads; i++)
+        if(scheds[i].count < sched->count)
+            sched = &scheds[i];
+    if((fiber = (FIBER *)calloc(1, sizeof(FIBER))) == NULL) {
+        logmsg(LOG_WARNING, "fiber_add() calloc");
+        return -1;
+    }
+    memcpy(&fiber->arg, arg, sizeof(thr_arg));
+    fiber->sched = sched;
+    __sync_fetch_and_add(&sched->count, 1);
+    (void)pthread_mutex_lock(&sched->mut);
+    fiber->next = sched->fresh;
+    sched->fresh = fiber;
+    first = (fiber->next == NULL);
+    (void)pthread_mutex_unlock(&sched->mut);
+    /* a full pipe has woken the scheduler already */
+    if(first && write(sched->wake[1], "", 1) < 0 && errno != EAGAIN)
+        logmsg(LOG_WARNING, "fiber_add() write: %s", strerror(errno));
+    return 0;
+}
+
+/*
+ * poll() a single descriptor - in a fiber the scheduler runs the others meanwhile
+ */
+int
+fiber_poll(struct pollfd *p, const int to)
+{
+    FIBER               *fiber;
+    SCHED               *sched;
+    struct epoll_event  ev;
+    int                 res;
+
+    if(to == 0 || scheds == NULL || (fiber = (FIBER *)pthread_getspecific(cur_fiber)) == NULL)
+        return poll(p, 1, to);
+    /* mostly the descriptor is ready already (always so for writing) - no need to switch then */
+    if((res = poll(p, 1, 0)) != 0)
+        return res;
+    sched = fiber->sched;
+    /* the POLL* values are the EPOLL* ones on Linux */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (p->events & (POLLIN | POLLPRI | POLLOUT)) | EPOLLONESHOT;
+    ev.data.ptr = fiber;
+    if(epoll_ctl(sched->efd, EPOLL_CTL_MOD, p->fd, &ev)
+    && (errno != ENOENT || epoll_ctl(sched->efd, EPOLL_CTL_ADD, p->fd, &ev))) {
+        logmsg(LOG_WARNING, "fiber_poll() epoll_ctl: %s", strerror(errno));
+        return poll(p, 1, to);
+    }
+    p->revents = 0;
+    fiber->wait = p;
+    fiber->expire = (to < 0)? 0: time(NULL) + (to + 999) / 1000;
+    fiber->prev = NULL;
+    if((fiber->next = sched->waiting) != NULL)
+        fiber->next->prev = fiber;
+    sched->waiting = fiber;
+    /* the OpenSSL error queue is per thread, so shared by the fibers of a scheduler: leave it empty */
+    ERR_clear_error();
+    swapcontext(&fiber->ctx, &sched->ctx);
+    ERR_clear_error();
+    return fiber->res;
+}
+
+static void
+fiber_main(void)
+{
+    FIBER   *fiber;
+
+    fiber = (FIBER *)pthread_getspecific(cur_fiber);
+    /* the connection keeps the services it started with, even across a reload */
+    fiber->arg.conf = get_svc_conf();
+    do_http(&fiber->arg);
+    put_svc_conf(fiber->arg.conf);
+    /* returning resumes the scheduler through uc_link */
+    return;
+}
+
+/*
+ * switch to the fiber until it waits or is done; res is what its fiber_poll() returns
+ */
+static void
+fiber_resume(SCHED *const sched, FIBER *const fiber, const int res)
+{
+    if(fiber->wait != NULL) {
+        fiber_unlink(sched, fiber);
+        fiber->wait = NULL;
+    }
+    fiber->res = res;
+    pthread_setspecific(cur_fiber, fiber);
+    swapcontext(&sched->ctx, &fiber->ctx);
+    pthread_setspecific(cur_fiber, NULL);
+    /* nothing the fiber left there concerns the next one */
+    ERR_clear_error();
+    if(fiber->wait != NULL)
+        return;
+
+    /* done - keep the stack for the next one */
+    if(sched->n_stacks < FIBER_CACHE)
+        sched->stacks[sched->n_stacks++] = fiber->stack;
+    else
+        munmap(fiber->stack, FIBER_STACK);
+    free(fiber);
+    __sync_fetch_and_sub(&sched->count, 1);
+    return;
+}
+
+static void
+fiber_start(SCHED *const sched, FIBER *const fiber)
+{
+    if(sched->n_stacks > 0)
+        fiber->stack = sched->stacks[--sched->n_stacks];
+    else if((fiber->stack = (char *)mmap(NULL, FIBER_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+        == MAP_FAILED || mprotect(fiber->stack, page_size, PROT_NONE)) {
+        logmsg(LOG_WARNING, "fiber_start() mmap: %s", strerror(errno));
+        if(fiber->stack != MAP_FAILED)
+            munmap(fiber->stack, FIBER_STACK);
+        reject_conn(&fiber->arg);
+        free(fiber);
+        __sync_fetch_and_sub(&sched->count, 1);
+        return;
+    }
+    getcontext(&fiber->ctx);
+    fiber->ctx.uc_stack.ss_sp = fiber->stack;
+    fiber->ctx.uc_stack.ss_size = FIBER_STACK;
+    fiber->ctx.uc_link = &sched->ctx;
+    makecontext(&fiber->ctx, fiber_main, 0);
+    fiber_resume(sched, fiber, 0);
+    return;
+}
+
+/*
+ * fiber scheduler thread: start the new connections and resume the fibers whose descriptors are ready
+ */
+static void *
+thr_fiber(void *arg)
+{
+    SCHED               *sched;
+    FIBER               *fiber, *next, *fresh;
+    struct epoll_event  events[EVT_BATCH];
+    time_t              now, last_sweep;
+    char                buf[64];
+    int                 i, n;
+
+    set_affinity(AFF_WORKER);
+    sched = (SCHED *)arg;
+    for(last_sweep = time(NULL);;) {
+        if((n = epoll_wait(sched->efd, events, EVT_BATCH, 1000)) < 0) {
+            if(errno != EINTR)
+                logmsg(LOG_WARNING, "thr_fiber() epoll_wait: %s", strerror(errno));
+            n = 0;
+        }
+        for(i = 0; i < n; i++) {
+            if((fiber = (FIBER *)events[i].data.ptr) != NULL) {
+                fiber->wait->revents = events[i].events & (POLLIN | POLLPRI | POLLOUT | POLLERR | POLLHUP);
+                fiber_resume(sched, fiber, 1);
+                continue;
+            }
+            /* new connections - start them in the order they came */
+            while(read(sched->wake[0], buf, sizeof(buf)) > 0)
+                ;
+            (void)pthread_mutex_lock(&sched->mut);
+            fiber = sched->fresh;
+            sched->fresh = NULL;
+            (void)pthread_mutex_unlock(&sched->mut);
+            for(fresh = NULL; fiber; fiber = next) {
+                next = fiber->next;
+                fiber->next = fresh;
+                fresh = fiber;
+            }
+            for(fiber = fresh; fiber; fiber = next) {
+                next = fiber->next;
+                fiber->next = NULL;
+                fiber_start(sched, fiber);
+            }
+        }
+
+        /* time out the waits that were not satisfied */
+        if((now = time(NULL)) == last_sweep)
+            continue;
+        last_sweep = now;
+        for(fiber = sched->waiting; fiber; fiber = next) {
+            next = fiber->next;
+            if(fiber->expire == 0 || fiber->expire >= now)
+                continue;
+            epoll_ctl(sched->efd, EPOLL_CTL_DEL, fiber->wait->fd, NULL);
+            fiber_resume(sched, fiber, 0);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * start the fiber scheduler threads
+ */
+void
+fiber_init(void)
+{
+    pthread_t           thr;
+    pthread_attr_t      attr;
+    struct epoll_event  ev;
+    int                 i;
+
+    if((scheds = (SCHED *)calloc(fiber_threads, sizeof(SCHED))) == NULL) {
+        logmsg(LOG_ERR, "fiber_init: out of memory - aborted");
+        exit(1);
+    }
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pthread_key_create(&cur_fiber, NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i = 0; i < fiber_threads; i++) {
+        if((scheds[i].efd = epoll_create(EVT_BATCH)) < 0 || pipe(scheds[i].wake)) {
+            logmsg(LOG_ERR, "fiber_init epoll_create/pipe: %s - aborted", strerror(errno));
+            exit(1);
+        }
+        fcntl(scheds[i].efd, F_SETFD, FD_CLOEXEC);
+        fcntl(scheds[i].wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(scheds[i].wake[1], F_SETFD, FD_CLOEXEC);
+        fcntl(scheds[i].wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(scheds[i].wake[1], F_SETFL, O_NONBLOCK);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(scheds[i].efd, EPOLL_CTL_ADD, scheds[i].wake[0], &ev)) {
+            logmsg(LOG_ERR, "fiber_init epoll_ctl: %s - aborted", strerror(errno));
+            exit(1);
+        }
+        pthread_mutex_init(&scheds[i].mut, NULL);
+        if(pthread_create(&thr, &attr, thr_fiber, &scheds[i])) {
+            logmsg(LOG_ERR, "create thr_fiber: %s - aborted", strerror(errno));
+            exit(1);
+        }
+    }
+    return;
+}
+
+#else
+
+int
+fiber_add(thr_arg *arg)
+{
+    return put_thr_arg(arg);
+}
+
+int
+fiber_poll(struct pollfd *p, const int to)
+{
+    return poll(p, 1, to);
+}
+
+void
+fiber_init(void)
+{
+    return;
+}
+
+#endif  /* FIBERS */
+
+/*
+ * acceptor stuff
+ *
+ * With Acceptors N (N > 1) every listener is opened N times with SO_REUSEPORT. The main
+ * thread accepts on the first socket of each listener, N - 1 acceptor threads on the others,
+ * and the kernel spreads the incoming connections over them.
+ */
+int                     acceptors;
+static pthread_t        *acceptor_thr = NULL;   /* the acceptor threads (the main thread is number 0) */
+static int              accept_stop[2] = { -1, -1 };    /* readable once the acceptor threads are to stop */
+
+/*
+ * binary upgrade stuff
+ *
+ * On USR2 Pound starts a new copy of itself (same binary path and arguments), passing the
+ * listening sockets by number in POUND_LISTENERS. The new process adopts those bound to the
+ * address of one of its listeners (and opens any others). It writes its pid to the pipe given
+ * in POUND_READY as soon as it has detached, and an 'R' once it is fully up (privileges dropped,
+ * workers and acceptors running). Only then does the old process close its listeners and drain
+ * within Grace, as on HUP, so the sockets are never closed in between. If the new process fails
+ * to start the old one stops it and just carries on.
+ *
+ * The new process must start as the old one did, but by then the old one may be chrooted and
+ * running as User: the upgrade is done by the upgrader, a process forked before the privileges
+ * are dropped. It does nothing but wait on its socket for the monitor (or the single process)
+ * to ask for an upgrade, and answers 'U' once the new process took over, 'F' if it failed.
+ * It exits once an upgrade succeeded or the other end is closed (with the listeners).
+ */
+#define UPGRADE_WAIT    60      /* seconds to wait for the new process */
+
+static char                     **pound_argv, *pound_exe;
+static int                      ready_fd = -1;
+static int                      upgrader = -1, upgrade_pending = 0;
+static pthread_t                main_thr;
+static volatile sig_atomic_t    do_upgrade = 0;
+static int                      *inherited = NULL, n_inherited = 0;
+
+/*
+ * find the absolute path of the binary we were started as - before any chdir or chroot.
+ * Symbolic links are kept, so an upgrade runs whatever they point to by then.
+ */
+static void
+init_exe(const char *argv0)
+{
+    char    path[MAXBUF], cwd[MAXBUF];
+    const char  *dir, *end;
+    int     len;
+
+    pound_exe = NULL;
+    if(argv0[0] == '/')
+        pound_exe = strdup(argv0);
+    else if(strchr(argv0, '/') != NULL) {
+        if(getcwd(cwd, sizeof(cwd)) != NULL && snprintf(path, sizeof(path), "%s/%s", cwd, argv0) < sizeof(path))
+            pound_exe = strdup(path);
+    } else if((dir = getenv("PATH")) != NULL)
+        /* found in the PATH, as the shell did */
+        while(pound_exe == NULL && *dir) {
+            if((end = strchr(dir, ':')) == NULL)
+                end = dir + strlen(dir);
+            if(*dir == '/' && snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dir), dir, argv0) < sizeof(path)
+            && access(path, X_OK) == 0)
+                pound_exe = strdup(path);
+            dir = *end? end + 1: end;
+        }
+    if(pound_exe == NULL && (len = readlink("/proc/self/exe", path, sizeof(path) - 1)) > 0) {
+        path[len] = '\0';
+        pound_exe = strdup(path);
+    }
+    if(pound_exe == NULL && (pound_exe = strdup(argv0)) == NULL) {
+        logmsg(LOG_ERR, "Out of memory for the binary path - aborted");
+        exit(1);
+    }
+    return;
+}
+
+/*
+ * pick up the listening sockets passed by the process we replace (if any)
+ */
+static void
+init_inherited(void)
+{
+    char    *cp;
+
+    if((cp = getenv("POUND_LISTENERS")) == NULL)
+        return;
+    while(*cp) {
+        if((inherited = (int *)realloc(inherited, (n_inherited + 1) * sizeof(int))) == NULL) {
+            logmsg(LOG_ERR, "Out of memory for inherited listeners - aborted");
+            exit(1);
+        }
+        inherited[n_inherited++] = strtol(cp, &cp, 10);
+        if(*cp != ',')
+            break;
+        cp++;
+    }
+    unsetenv("POUND_LISTENERS");
+    return;
+}
+
+/*
+ * find (and take) an inherited socket bound to the address of lstn - -1 if none
  */
-static thr_arg          *first = NULL, *last = NULL;
-static pthread_cond_t   arg_cond;
-static pthread_mutex_t  arg_mut;
-int                     numthreads;
+static int
+find_inherited(LISTENER *lstn)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    int                     i, sock;
+
+    for(i = 0; i < n_inherited; i++) {
+        if((sock = inherited[i]) < 0)
+            continue;
+        len = (socklen_t)sizeof(addr);
+        if(getsockname(sock, (struct sockaddr *)&addr, &len) < 0 || addr.ss_family != lstn->addr.ai_family)
+            continue;
+        if(addr.ss_family == AF_INET) {
+            struct sockaddr_in  *a = (struct sockaddr_in *)&addr, *b = (struct sockaddr_in *)lstn->addr.ai_addr;
 
+            if(a->sin_port != b->sin_port || memcmp(&a->sin_addr, &b->sin_addr, sizeof(a->sin_addr)))
+                continue;
+        } else if(addr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *a = (struct sockaddr_in6 *)&addr, *b = (struct sockaddr_in6 *)lstn->addr.ai_addr;
+
+            if(a->sin6_port != b->sin6_port || memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)))
+                continue;
+        } else
+            continue;
+        inherited[i] = -1;
+        return sock;
+    }
+    return -1;
+}
+
+/*
+ * close the inherited sockets no listener wanted - the old process is told we are ready later
+ */
 static void
-init_thr_arg(void)
+end_inherited(void)
 {
-    pthread_cond_init(&arg_cond, NULL);
-    pthread_mutex_init(&arg_mut, NULL);
+    char    *cp;
+    int     i;
+
+    for(i = 0; i < n_inherited; i++)
+        if(inherited[i] >= 0)
+            close(inherited[i]);
+    free(inherited);
+    inherited = NULL;
+    n_inherited = 0;
+    if((cp = getenv("POUND_READY")) != NULL) {
+        ready_fd = atoi(cp);
+        unsetenv("POUND_READY");
+    }
     return;
 }
 
 /*
- * add a request to the queue
+ * tell the process we replace (if any) our pid - it stops us if we do not get ready in time
  */
-int
-put_thr_arg(thr_arg *arg)
+static void
+upgrade_pid(void)
+{
+    char    buf[32];
+    int     len;
+
+    if(ready_fd < 0)
+        return;
+    len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+    if(write(ready_fd, buf, len) != len)
+        logmsg(LOG_WARNING, "upgrade pid: %s", strerror(errno));
+    return;
+}
+
+/*
+ * tell the process we replace (if any) that we are serving - it stops accepting then
+ */
+static void
+upgrade_ready(void)
+{
+    if(ready_fd < 0)
+        return;
+    /* EPIPE: another worker was first */
+    if(write(ready_fd, "R", 1) != 1 && errno != EPIPE)
+        logmsg(LOG_WARNING, "upgrade ready: %s", strerror(errno));
+    close(ready_fd);
+    ready_fd = -1;
+    return;
+}
+
+/*
+ * upgrader: start the new binary and wait for it to take over the listeners - 0 on success
+ */
+static int
+upgrade(void)
 {
-    thr_arg *res;
+    extern char     **environ;
+    LISTENER        *lstn;
+    char            **envp, *fds, ready[32], msg[64];
+    FILE            *fpid;
+    struct pollfd   p;
+    int             pipes[2], n, i, len, fd, max_fd, res;
+    time_t          end, left;
+    pid_t           son, pid;
 
-    if((res = malloc(sizeof(thr_arg))) == NULL) {
-        logmsg(LOG_WARNING, "thr_arg malloc");
+    /* everything is prepared before the fork: the child only closes and execs */
+    for(lstn = listeners, n = 0; lstn; lstn = lstn->next)
+        n += lstn->n_shards;
+    if((fds = (char *)malloc(n * 12 + 32)) == NULL) {
+        logmsg(LOG_ERR, "upgrade: out of memory");
         return -1;
     }
-    memcpy(res, arg, sizeof(thr_arg));
-    res->next = NULL;
-    (void)pthread_mutex_lock(&arg_mut);
-    if(last == NULL)
-        first = last = res;
-    else {
-        last->next = res;
-        last = last->next;
+    len = snprintf(fds, 32, "POUND_LISTENERS=");
+    for(lstn = listeners; lstn; lstn = lstn->next)
+        for(i = 0; i < lstn->n_shards; i++)
+            len += sprintf(fds + len, "%s%d", fds[len - 1] == '='? "": ",", lstn->shards[i]);
+    for(n = 0; environ[n]; n++)
+        ;
+    if((envp = (char **)calloc(n + 3, sizeof(char *))) == NULL) {
+        logmsg(LOG_ERR, "upgrade: out of memory");
+        free(fds);
+        return -1;
     }
-    (void)pthread_mutex_unlock(&arg_mut);
-    pthread_cond_signal(&arg_cond);
+    for(n = i = 0; environ[n]; n++)
+        if(strncmp(environ[n], "POUND_LISTENERS=", 16) && strncmp(environ[n], "POUND_READY=", 12))
+            envp[i++] = environ[n];
+    envp[i++] = fds;
+    envp[i++] = ready;
+    if((max_fd = (int)sysconf(_SC_OPEN_MAX)) < 0)
+        max_fd = 1024;
+    if(pipe(pipes) < 0) {
+        logmsg(LOG_ERR, "upgrade pipe: %s", strerror(errno));
+        free(envp);
+        free(fds);
+        return -1;
+    }
+    snprintf(ready, sizeof(ready), "POUND_READY=%d", pipes[1]);
+
+    if((son = fork()) == 0) {
+        /* keep only stdio, the listeners and the pipe */
+        for(fd = 3; fd < max_fd; fd++) {
+            if(fd == pipes[1])
+                continue;
+            for(lstn = listeners; lstn; lstn = lstn->next) {
+                for(i = 0; i < lstn->n_shards && lstn->shards[i] != fd; i++)
+                    ;
+                if(i < lstn->n_shards)
+                    break;
+            }
+            if(lstn == NULL)
+                close(fd);
+        }
+        execve(pound_exe, pound_argv, envp);
+        _exit(1);
+    }
+    free(envp);
+    free(fds);
+    close(pipes[1]);
+    if(son < 0) {
+        logmsg(LOG_ERR, "upgrade fork: %s", strerror(errno));
+        close(pipes[0]);
+        return -1;
+    }
+
+    /* its pid first (it is not son if it detached), then 'R' */
+    p.fd = pipes[0];
+    p.events = POLLIN;
+    pid = son;
+    for(len = res = 0, end = time(NULL) + UPGRADE_WAIT; !res && len < sizeof(msg) - 1 && (left = end - time(NULL)) > 0; ) {
+        if((n = poll(&p, 1, (int)left * 1000)) < 0 && errno == EINTR)
+            continue;
+        if(n <= 0 || (n = read(pipes[0], msg + len, sizeof(msg) - 1 - len)) <= 0)
+            break;
+        msg[len += n] = '\0';
+        if(strchr(msg, '\n') != NULL)
+            pid = atoi(msg);
+        res = (strchr(msg, 'R') != NULL);
+    }
+    close(pipes[0]);
+    if(!res) {
+        logmsg(LOG_ERR, "upgrade: %s (pid %d) did not start - carrying on", pound_exe, pid);
+        /* son is not reaped yet, so its pid cannot have been reused */
+        kill(son, SIGTERM);
+        if(pid != son)
+            kill(pid, SIGTERM);
+        /* it may have written its pid already - the file is the monitor's (our parent's) again */
+        if((fpid = fopen(pid_name, "wt")) != NULL) {
+            fprintf(fpid, "%d\n", getppid());
+            fclose(fpid);
+        }
+        return -1;
+    }
+    logmsg(LOG_NOTICE, "upgrade: %s (pid %d) took over the listeners", pound_exe, pid);
     return 0;
 }
 
 /*
- * get a request from the queue
+ * the upgrader: do the upgrades asked for on sock until one succeeds or the other end is closed
  */
-thr_arg *
-get_thr_arg(void)
+static void
+run_upgrader(const int sock)
 {
-    thr_arg *res;
+    char    c;
 
-    (void)pthread_mutex_lock(&arg_mut);
-    if(first == NULL)
-        (void)pthread_cond_wait(&arg_cond, &arg_mut);
-    if((res = first) != NULL)
-        if((first = first->next) == NULL)
-            last = NULL;
-    (void)pthread_mutex_unlock(&arg_mut);
-    if(first != NULL)
-        pthread_cond_signal(&arg_cond);
-    return res;
+    /* the monitor (or the single process) tells it when to go */
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    while(read(sock, &c, 1) == 1) {
+        /* what earlier attempts left behind */
+        while(waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        c = upgrade() == 0? 'U': 'F';
+        if(write(sock, &c, 1) != 1 || c == 'U')
+            break;
+    }
+    exit(0);
 }
 
 /*
- * get the current queue length
+ * fork the upgrader - while we still have the privileges and root directory we were started with
  */
-get_thr_qlen(void)
+static void
+init_upgrader(void)
 {
-    int     res;
-    thr_arg *tap;
+    int     sv[2];
 
-    (void)pthread_mutex_lock(&arg_mut);
-    for(res = 0, tap = first; tap != NULL; tap = tap->next, res++)
-        ;
-    (void)pthread_mutex_unlock(&arg_mut);
-    return res;
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        logmsg(LOG_WARNING, "upgrader socketpair: %s - no upgrades", strerror(errno));
+        return;
+    }
+    switch(fork()) {
+    case 0:
+        close(sv[0]);
+        if(control_sock >= 0)
+            close(control_sock);
+        if(ready_fd >= 0)
+            close(ready_fd);
+        run_upgrader(sv[1]);
+        break;
+    case -1:
+        logmsg(LOG_WARNING, "upgrader fork: %s - no upgrades", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    close(sv[1]);
+    upgrader = sv[0];
+    return;
+}
+
+/*
+ * ask the upgrader for an upgrade - its answer is picked up by upgrade_check()
+ */
+static void
+upgrade_start(void)
+{
+    if(upgrade_pending)
+        return;
+    if(upgrader < 0 || write(upgrader, "U", 1) != 1) {
+        logmsg(LOG_ERR, "upgrade: no upgrader - restart Pound instead");
+        return;
+    }
+    upgrade_pending = 1;
+    return;
+}
+
+/*
+ * wait up to to milliseconds for the answer of the upgrader (if one is due) - 1 if the new
+ * process took over
+ */
+static int
+upgrade_check(const int to)
+{
+    struct pollfd   p;
+    char            c;
+
+    if(!upgrade_pending)
+        return 0;
+    memset(&p, 0, sizeof(p));
+    p.fd = upgrader;
+    p.events = POLLIN;
+    if(poll(&p, 1, to) <= 0)
+        return 0;
+    upgrade_pending = 0;
+    if(read(upgrader, &c, 1) == 1)
+        return c == 'U';
+    logmsg(LOG_ERR, "upgrade: the upgrader is gone - no more upgrades");
+    close(upgrader);
+    upgrader = -1;
+    return 0;
+}
+
+/*
+ * socket/bind one listening socket for lstn
+ */
+static int
+bind_listener(LISTENER *lstn, const int reuse_port)
+{
+    int     sock, opt;
+    char    tmp[MAXBUF];
+
+    if((sock = socket(lstn->addr.ai_family == AF_INET? PF_INET: PF_INET6, SOCK_STREAM, 0)) < 0) {
+        addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
+        logmsg(LOG_ERR, "HTTP socket %s create: %s - aborted", tmp, strerror(errno));
+        exit(1);
+    }
+    opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&opt, sizeof(opt));
+#ifdef  SO_REUSEPORT
+    if(reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&opt, sizeof(opt))) {
+        addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
+        logmsg(LOG_ERR, "HTTP socket %s SO_REUSEPORT: %s - aborted", tmp, strerror(errno));
+        exit(1);
+    }
+#endif
+    if(bind(sock, lstn->addr.ai_addr, (socklen_t)lstn->addr.ai_addrlen) < 0) {
+        addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
+        logmsg(LOG_ERR, "HTTP socket bind %s: %s - aborted", tmp, strerror(errno));
+        exit(1);
+    }
+    return sock;
+}
+
+/*
+ * open (or take over) and listen on one listening socket for lstn
+ */
+static int
+open_listener(LISTENER *lstn, const int reuse_port)
+{
+    int     sock, opt;
+    char    tmp[MAXBUF];
+
+    if((sock = find_inherited(lstn)) < 0)
+        sock = bind_listener(lstn, reuse_port);
+#ifdef  INHERIT_SOCKOPTS
+    set_sock_opts(sock);
+#endif
+#ifdef  TCP_DEFER_ACCEPT
+    if(lstn->defer_accept > 0)
+        setsockopt(sock, SOL_TCP, TCP_DEFER_ACCEPT, (void *)&lstn->defer_accept, sizeof(lstn->defer_accept));
+#endif
+    /* the accept loop drains the listener until it would block */
+    if((opt = fcntl(sock, F_GETFL, 0)) < 0 || fcntl(sock, F_SETFL, opt | O_NONBLOCK) < 0) {
+        addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
+        logmsg(LOG_ERR, "HTTP socket %s non-blocking: %s - aborted", tmp, strerror(errno));
+        exit(1);
+    }
+    listen(sock, 512);
+    return sock;
+}
+
+/*
+ * close all listening sockets - the acceptor threads are stopped first, as they must not
+ * poll the sockets once closed (nor whatever else gets their numbers next)
+ */
+static void
+close_listeners(void)
+{
+    LISTENER    *lstn;
+    int         i;
+
+    if(acceptor_thr != NULL) {
+        if(write(accept_stop[1], "S", 1) != 1)
+            logmsg(LOG_WARNING, "acceptor stop: %s", strerror(errno));
+        else
+            for(i = 1; i < acceptors; i++)
+                pthread_join(acceptor_thr[i], NULL);
+    }
+    for(lstn = listeners; lstn; lstn = lstn->next)
+        for(i = 0; i < lstn->n_shards; i++)
+            close(lstn->shards[i]);
+    /* the upgrader holds them too - it exits when this is closed */
+    if(upgrader >= 0) {
+        close(upgrader);
+        upgrader = -1;
+    }
+    return;
+}
+
+/*
+ * accept the pending connections on sock (belonging to lstn) and pass them on for processing
+ */
+static void
+do_accept(LISTENER *lstn, const int sock)
+{
+    int                     clnt_length, clnt, n;
+    thr_arg                 arg;
+
+    for(n = 0; n < ACCEPT_BATCH; n++) {
+        memset(&arg, 0, sizeof(arg));
+        clnt_length = sizeof(arg.from_addr);
+#if HAVE_ACCEPT4
+        clnt = accept4(sock, (struct sockaddr *)&arg.from_addr, (socklen_t *)&clnt_length, SOCK_CLOEXEC);
+#else
+        if((clnt = accept(sock, (struct sockaddr *)&arg.from_addr, (socklen_t *)&clnt_length)) >= 0) {
+            /* some systems pass O_NONBLOCK on from the listener */
+            fcntl(clnt, F_SETFL, fcntl(clnt, F_GETFL, 0) & ~O_NONBLOCK);
+            fcntl(clnt, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if(clnt < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                logmsg(LOG_WARNING, "HTTP accept: %s", strerror(errno));
+            return;
+        }
+        if(arg.from_addr.ss_family != AF_INET && arg.from_addr.ss_family != AF_INET6) {
+            /* may happen on FreeBSD, I am told */
+            logmsg(LOG_WARNING, "HTTP connection prematurely closed by peer");
+            close(clnt);
+            continue;
+        }
+        if(lstn->disabled) {
+            /*
+            addr2str(tmp, MAXBUF - 1, &arg.from_host, 1);
+            logmsg(LOG_WARNING, "HTTP disabled listener from %s", tmp);
+            */
+            close(clnt);
+            continue;
+        }
+        arg.sock = clnt;
+        arg.lstn = lstn;
+        arg.from_host.ai_addrlen = clnt_length;
+        arg.from_host.ai_family = arg.from_addr.ss_family;
+        if(fiber_threads > 0? fiber_add(&arg): evt_threads > 0? evt_add(&arg): put_thr_arg(&arg))
+            reject_conn(&arg);
+    }
+    return;
+}
+
+/*
+ * acceptor thread: accept on the shard-th socket of every listener
+ */
+static void *
+thr_accept(void *arg)
+{
+    int             shard, n_listeners, i;
+    struct pollfd   *polls;
+    LISTENER        *lstn;
+
+    set_affinity(AFF_ACCEPT);
+    shard = (int)(long)arg;
+    for(lstn = listeners, n_listeners = 0; lstn; lstn = lstn->next)
+        n_listeners++;
+    /* one more for the stop pipe */
+    if((polls = (struct pollfd *)calloc(n_listeners + 1, sizeof(struct pollfd))) == NULL) {
+        logmsg(LOG_ERR, "Out of memory for acceptor poll - aborted");
+        exit(1);
+    }
+    for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++)
+        polls[i].fd = lstn->shards[shard];
+    polls[n_listeners].fd = accept_stop[0];
+    for(;;) {
+        for(i = 0; i <= n_listeners; i++) {
+            polls[i].events = POLLIN | POLLPRI;
+            polls[i].revents = 0;
+        }
+        if(poll(polls, n_listeners + 1, -1) < 0) {
+            logmsg(LOG_WARNING, "acceptor poll: %s", strerror(errno));
+            continue;
+        }
+        if(polls[n_listeners].revents) {
+            /* the listeners are about to be closed */
+            free(polls);
+            return NULL;
+        }
+        for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++)
+            if(polls[i].revents & (POLLIN | POLLPRI))
+                do_accept(lstn, polls[i].fd);
+    }
+}
+
+/*
+ * affinity stuff
+ *
+ * Each kind of thread may be restricted to a set of CPUs. The worker CPUs are further split
+ * by NUMA node and the workers are spread over the nodes, each pinned to the CPUs of one,
+ * so that (by the first-touch policy) their stacks and buffers live in local memory.
+ */
+#if HAVE_PTHREAD_SETAFFINITY_NP
+cpu_set_t               *acceptor_cpus = NULL, *worker_cpus = NULL, *control_cpus = NULL;
+
+static cpu_set_t        *worker_nodes = NULL;   /* worker_cpus by NUMA node */
+static int              n_worker_nodes = 0;
+static volatile int     worker_next = 0;
+
+/*
+ * split worker_cpus by NUMA node (as per /sys) - must run after the configuration was parsed
+ */
+static void
+init_affinity(void)
+{
+    cpu_set_t   node;
+    FILE        *f;
+    char        name[MAXBUF], *cp;
+    int         n, from, to;
+
+    if(worker_cpus == NULL)
+        return;
+    for(n = 0; ; n++) {
+        snprintf(name, MAXBUF, "/sys/devices/system/node/node%d/cpulist", n);
+        if((f = fopen(name, "r")) == NULL)
+            break;
+        CPU_ZERO(&node);
+        if(fgets(name, MAXBUF, f) != NULL)
+            for(cp = name; *cp && *cp != '\n'; ) {
+                from = to = strtol(cp, &cp, 10);
+                if(*cp == '-')
+                    to = strtol(cp + 1, &cp, 10);
+                for(; from <= to && from < CPU_SETSIZE; from++)
+                    CPU_SET(from, &node);
+                if(*cp == ',')
+                    cp++;
+                else
+                    break;
+            }
+        fclose(f);
+        CPU_AND(&node, &node, worker_cpus);
+        if(CPU_COUNT(&node) == 0)
+            continue;
+        if((worker_nodes = (cpu_set_t *)realloc(worker_nodes, (n_worker_nodes + 1) * sizeof(cpu_set_t))) == NULL) {
+            logmsg(LOG_ERR, "init_affinity: out of memory - aborted");
+            exit(1);
+        }
+        worker_nodes[n_worker_nodes++] = node;
+    }
+    if(n_worker_nodes == 0) {
+        /* no NUMA information: just use the set as is */
+        worker_nodes = worker_cpus;
+        n_worker_nodes = 1;
+    }
+    return;
+}
+
+/*
+ * pin the calling thread to the CPUs configured for its kind
+ */
+void
+set_affinity(const int kind)
+{
+    cpu_set_t   *cpus;
+    int         res;
+
+    switch(kind) {
+    case AFF_ACCEPT:
+        cpus = acceptor_cpus;
+        break;
+    case AFF_WORKER:
+        cpus = worker_cpus == NULL? NULL
+            : &worker_nodes[(unsigned int)__sync_fetch_and_add(&worker_next, 1) % n_worker_nodes];
+        break;
+    default:
+        cpus = control_cpus;
+        break;
+    }
+    if(cpus != NULL && (res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus)))
+        logmsg(LOG_WARNING, "set_affinity: %s", strerror(res));
+    return;
+}
+
+#else
+
+static void
+init_affinity(void)
+{
+    return;
+}
+
+void
+set_affinity(const int kind)
+{
+    return;
 }
 
+#endif  /* HAVE_PTHREAD_SETAFFINITY_NP */
+
 /*
  * handle SIGTERM/SIGQUIT - exit
  */
 static RETSIGTYPE
 h_term(const int sig)
 {
+    int i;
+
     logmsg(LOG_NOTICE, "received signal %d - exiting...", sig);
-    if(son > 0)
-        kill(son, sig);
+    if(sons != NULL)
+        for(i = 0; i < n_workers; i++)
+            if(sons[i] > 0)
+                kill(sons[i], sig);
+    if(ctrl_name != NULL)
+        (void)unlink(ctrl_name);
+    exit(0);
+}
+
+/*
+ * monitor: stop accepting, have the workers drain and exit with them
+ */
+static void
+stop_sons(const int sig)
+{
+    int         status, i;
+
+    close_listeners();
+    for(i = 0; i < n_workers; i++)
+        if(sons[i] > 0)
+            kill(sons[i], sig);
+    for(i = 0; i < n_workers; i++)
+        if(sons[i] > 0)
+            (void)waitpid(sons[i], &status, 0);
     if(ctrl_name != NULL)
         (void)unlink(ctrl_name);
     exit(0);
@@ -202,20 +1797,76 @@ h_term(const int sig)
 static RETSIGTYPE
 h_shut(const int sig)
 {
-    int         status;
-    LISTENER    *lstn;
-
     logmsg(LOG_NOTICE, "received signal %d - shutting down...", sig);
-    if(son > 0) {
-        for(lstn = listeners; lstn; lstn = lstn->next)
-            close(lstn->sock);
-        kill(son, sig);
-        (void)wait(&status);
-        if(ctrl_name != NULL)
-            (void)unlink(ctrl_name);
-        exit(0);
-    } else
+    if(sons != NULL)
+        stop_sons(sig);
+    else
+        shut_down = 1;
+}
+
+/*
+ * handle SIGUSR2 - start the new binary, then stop accepting and drain within the grace period
+ *
+ * The monitor (or a single process) asks the upgrader for it in its main loop; a worker process
+ * gets the signal from its monitor once the new binary took over, and drains leaving the control
+ * socket to the new one. Either way the main thread must see it to leave wait()/poll().
+ */
+static RETSIGTYPE
+h_upgrade(const int sig)
+{
+#ifdef  UPER
+    if(sons == NULL) {
+        ctrl_name = NULL;
         shut_down = 1;
+    } else
+#endif
+        do_upgrade = 1;
+    if(!pthread_equal(pthread_self(), main_thr))
+        pthread_kill(main_thr, sig);
+}
+
+/*
+ * handle SIGUSR1 - reload the services
+ *
+ * The monitor passes the signal on to the workers. A worker (or a single process) notes it for
+ * the main thread, which starts thr_reload().
+ */
+static volatile sig_atomic_t    do_reload = 0;
+
+static RETSIGTYPE
+h_reload(const int sig)
+{
+    int i;
+
+    if(sons != NULL) {
+        for(i = 0; i < n_workers; i++)
+            if(sons[i] > 0)
+                kill(sons[i], sig);
+        return;
+    }
+    do_reload = 1;
+    if(!pthread_equal(pthread_self(), main_thr))
+        pthread_kill(main_thr, sig);
+}
+
+/*
+ * re-read the services from the config file and make them current - one reload at a time
+ */
+static void *
+thr_reload(void *arg)
+{
+    static pthread_mutex_t  reload_mut = PTHREAD_MUTEX_INITIALIZER;
+    SVC_CONF                *conf;
+
+    pthread_mutex_lock(&reload_mut);
+    if((conf = config_reload()) == NULL)
+        logmsg(LOG_ERR, "reload failed - running configuration unchanged");
+    else {
+        set_svc_conf(conf);
+        logmsg(LOG_NOTICE, "services reloaded");
+    }
+    pthread_mutex_unlock(&reload_mut);
+    return NULL;
 }
 
 /*
@@ -228,7 +1879,9 @@ h_shut(const int sig)
 int
 main(const int argc, char **argv)
 {
-    int                 n_listeners, i, clnt_length, clnt;
+    int                 n_listeners, i;
+    pid_t               son;
+    struct sigaction    sa;
     struct pollfd       *polls;
     LISTENER            *lstn;
     pthread_t           thr;
@@ -237,8 +1890,6 @@ main(const int argc, char **argv)
     uid_t               user_id;
     gid_t               group_id;
     FILE                *fpid;
-    struct sockaddr_storage clnt_addr;
-    char                tmp[MAXBUF];
 #ifndef SOL_TCP
     struct protoent     *pe;
 #endif
@@ -254,6 +1905,15 @@ main(const int argc, char **argv)
     signal(SIGTERM, h_term);
     signal(SIGQUIT, h_term);
     signal(SIGPIPE, SIG_IGN);
+    /* no SA_RESTART: the monitor must leave wait() to start the upgrade */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = h_upgrade;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    signal(SIGUSR1, h_reload);
+    pound_argv = argv;
+    init_exe(argv[0]);
+    main_thr = pthread_self();
 
     srandom(getpid());
 
@@ -262,17 +1922,12 @@ main(const int argc, char **argv)
     SSL_library_init();
     OpenSSL_add_all_algorithms();
     l_init();
-    init_thr_arg();
     CRYPTO_set_id_callback(l_id);
     CRYPTO_set_locking_callback(l_lock);
     init_timer();
 
     /* prepare regular expressions */
-    if(regcomp(&HEADER, "^([a-z0-9!#$%&'*+.^_`|~-]+):[ \t]*(.*)[ \t]*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    || regcomp(&CHUNK_HEAD, "^([0-9a-f]+).*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    || regcomp(&RESP_SKIP, "^HTTP/1.1 100.*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    || regcomp(&RESP_IGN, "^HTTP/1.[01] (10[1-9]|1[1-9][0-9]|204|30[456]).*$", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
-    || regcomp(&LOCATION, "(http|https)://([^/]+)(.*)", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
+    if(regcomp(&LOCATION, "(http|https)://([^/]+)(.*)", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     || regcomp(&AUTHORIZATION, "Authorization:[ \t]*Basic[ \t]*\"?([^ \t]*)\"?[ \t]*", REG_ICASE | REG_NEWLINE | REG_EXTENDED)
     ) {
         logmsg(LOG_ERR, "bad essential Regex - aborted");
@@ -290,6 +1945,9 @@ main(const int argc, char **argv)
 
     /* read config */
     config_parse(argc, argv);
+    init_svc_conf();
+    init_thr_arg();
+    init_affinity();
 
     if(log_facility != -1)
         openlog("pound", LOG_CONS | LOG_NDELAY, LOG_DAEMON);
@@ -311,25 +1969,19 @@ main(const int argc, char **argv)
         listen(control_sock, 512);
     }
 
-    /* open listeners */
+    /* open listeners - taking over those of the process we replace (if any) */
+    init_inherited();
     for(lstn = listeners, n_listeners = 0; lstn; lstn = lstn->next, n_listeners++) {
-        int opt;
-
-        /* prepare the socket */
-        if((lstn->sock = socket(lstn->addr.ai_family == AF_INET? PF_INET: PF_INET6, SOCK_STREAM, 0)) < 0) {
-            addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
-            logmsg(LOG_ERR, "HTTP socket %s create: %s - aborted", tmp, strerror(errno));
-            exit(1);
-        }
-        opt = 1;
-        setsockopt(lstn->sock, SOL_SOCKET, SO_REUSEADDR, (void *)&opt, sizeof(opt));
-        if(bind(lstn->sock, lstn->addr.ai_addr, (socklen_t)lstn->addr.ai_addrlen) < 0) {
-            addr2str(tmp, MAXBUF - 1, &lstn->addr, 0);
-            logmsg(LOG_ERR, "HTTP socket bind %s: %s - aborted", tmp, strerror(errno));
+        lstn->n_shards = acceptors > 1? acceptors: 1;
+        if((lstn->shards = (int *)calloc(lstn->n_shards, sizeof(int))) == NULL) {
+            logmsg(LOG_ERR, "Out of memory for listener sockets - aborted");
             exit(1);
         }
-        listen(lstn->sock, 512);
+        for(i = 0; i < lstn->n_shards; i++)
+            lstn->shards[i] = open_listener(lstn, lstn->n_shards > 1);
+        lstn->sock = lstn->shards[0];
     }
+    end_inherited();
 
     /* alloc the poll structures */
     if((polls = (struct pollfd *)calloc(n_listeners, sizeof(struct pollfd))) == NULL) {
@@ -391,6 +2043,10 @@ main(const int argc, char **argv)
         fclose(fpid);
     } else
         logmsg(LOG_NOTICE, "Create \"%s\": %s", pid_name, strerror(errno));
+    upgrade_pid();
+
+    /* the upgrades are done by a process that keeps the privileges and root directory */
+    init_upgrader();
 
     /* chroot if necessary */
     if(root_jail) {
@@ -415,20 +2071,62 @@ main(const int argc, char **argv)
             exit(1);
         }
 
-    /* split off into monitor and working process if necessary */
+    /* split off into monitor and working processes if necessary */
+#ifdef  UPER
+    if((sons = (pid_t *)calloc(n_workers, sizeof(pid_t))) == NULL) {
+        logmsg(LOG_ERR, "Out of memory for worker pids - aborted");
+        exit(1);
+    }
+#endif
     for(;;) {
 #ifdef  UPER
-        if((son = fork()) > 0) {
+        /* (re)start the worker processes that are not running */
+        for(son = -1, i = 0; i < n_workers; i++)
+            if(sons[i] == 0 && (sons[i] = son = fork()) <= 0)
+                break;
+        if(i == n_workers) {
             int status;
 
-            (void)wait(&status);
+            /* the workers tell the process we replace when they are up - not the monitor */
+            if(ready_fd >= 0) {
+                close(ready_fd);
+                ready_fd = -1;
+            }
+
+            if(do_upgrade) {
+                do_upgrade = 0;
+                upgrade_start();
+            }
+            if(upgrade_pending) {
+                /* the workers are reaped (and restarted) while the new process starts */
+                if(upgrade_check(1000)) {
+                    /* the control socket is the new process' now */
+                    ctrl_name = NULL;
+                    stop_sons(SIGUSR2);
+                }
+                if((son = waitpid(-1, &status, WNOHANG)) <= 0)
+                    continue;
+            } else if((son = wait(&status)) < 0)
+                continue;
+            for(i = 0; i < n_workers && sons[i] != son; i++)
+                ;
+            if(i == n_workers)
+                continue;
+            sons[i] = 0;
             if(WIFEXITED(status))
-                logmsg(LOG_ERR, "MONITOR: worker exited normally %d, restarting...", WEXITSTATUS(status));
+                logmsg(LOG_ERR, "MONITOR: worker %d exited normally %d, restarting...", son, WEXITSTATUS(status));
             else if(WIFSIGNALED(status))
-                logmsg(LOG_ERR, "MONITOR: worker exited on signal %d, restarting...", WTERMSIG(status));
+                logmsg(LOG_ERR, "MONITOR: worker %d exited on signal %d, restarting...", son, WTERMSIG(status));
             else
-                logmsg(LOG_ERR, "MONITOR: worker exited (stopped?) %d, restarting...", status);
+                logmsg(LOG_ERR, "MONITOR: worker %d exited (stopped?) %d, restarting...", son, status);
         } else if (son == 0) {
+            /* the worker has no sons of its own - and leaves the upgrades to the monitor */
+            free(sons);
+            sons = NULL;
+            if(upgrader >= 0) {
+                close(upgrader);
+                upgrader = -1;
+            }
 #endif
 
             /* thread stuff */
@@ -457,22 +2155,66 @@ main(const int argc, char **argv)
             /* pause to make sure the service threads were started */
             sleep(1);
 
-            /* create the worker threads */
-            for(i = 0; i < numthreads; i++)
-                if(pthread_create(&thr, &attr, thr_http, NULL)) {
-                    logmsg(LOG_ERR, "create thr_http: %s - aborted", strerror(errno));
+            /* create the worker threads - or the fiber schedulers that replace them */
+            if(fiber_threads > 0)
+                fiber_init();
+            else {
+                for(i = 0; i < min_threads; i++)
+                    if(new_worker()) {
+                        logmsg(LOG_ERR, "create thr_http - aborted");
+                        exit(1);
+                    }
+                for(lstn = listeners; lstn; lstn = lstn->next)
+                    new_reserved(lstn);
+            }
+
+            /* start the event engine (if needed) */
+            if(evt_threads > 0)
+                evt_init();
+
+            /* start the acceptor threads - the main thread accepts on the first socket */
+            if(acceptors > 1) {
+                if((acceptor_thr = (pthread_t *)calloc(acceptors, sizeof(pthread_t))) == NULL || pipe(accept_stop)) {
+                    logmsg(LOG_ERR, "acceptor threads: %s - aborted", strerror(errno));
                     exit(1);
                 }
+                /* joined before the listeners are closed */
+                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+                for(i = 1; i < acceptors; i++)
+                    if(pthread_create(&acceptor_thr[i], &attr, thr_accept, (void *)(long)i)) {
+                        logmsg(LOG_ERR, "create thr_accept: %s - aborted", strerror(errno));
+                        exit(1);
+                    }
+                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            }
 
             /* pause to make sure at least some of the worker threads were started */
             sleep(1);
 
+            /* the main thread is an acceptor too - pin it only now, as the threads it starts inherit this */
+            set_affinity(AFF_ACCEPT);
+
+            /* up and running: the process we replace (if any) may stop accepting now */
+            upgrade_ready();
+
             /* and start working */
             for(;;) {
+                if(do_reload) {
+                    do_reload = 0;
+                    if(pthread_create(&thr, &attr, thr_reload, NULL))
+                        logmsg(LOG_WARNING, "create thr_reload: %s", strerror(errno));
+                }
+                if(do_upgrade) {
+                    do_upgrade = 0;
+                    upgrade_start();
+                }
+                if(upgrade_check(0)) {
+                    ctrl_name = NULL;
+                    shut_down = 1;
+                }
                 if(shut_down) {
                     logmsg(LOG_NOTICE, "shutting down...");
-                    for(lstn = listeners; lstn; lstn = lstn->next)
-                        close(lstn->sock);
+                    close_listeners();
                     if(grace > 0) {
                         sleep(grace);
                         logmsg(LOG_NOTICE, "grace period expired - exiting...");
@@ -485,49 +2227,14 @@ main(const int argc, char **argv)
                     polls[i].events = POLLIN | POLLPRI;
                     polls[i].revents = 0;
                 }
-                if(poll(polls, n_listeners, -1) < 0) {
-                    logmsg(LOG_WARNING, "poll: %s", strerror(errno));
+                if(poll(polls, n_listeners, upgrade_pending? 1000: -1) < 0) {
+                    /* EINTR: a signal for the main thread (reload, upgrade, shutdown) */
+                    if(errno != EINTR)
+                        logmsg(LOG_WARNING, "poll: %s", strerror(errno));
                 } else {
-                    for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++) {
-                        if(polls[i].revents & (POLLIN | POLLPRI)) {
-                            memset(&clnt_addr, 0, sizeof(clnt_addr));
-                            clnt_length = sizeof(clnt_addr);
-                            if((clnt = accept(lstn->sock, (struct sockaddr *)&clnt_addr,
-                                (socklen_t *)&clnt_length)) < 0) {
-                                logmsg(LOG_WARNING, "HTTP accept: %s", strerror(errno));
-                            } else if(((struct sockaddr_in *)&clnt_addr)->sin_family == AF_INET
-                                   || ((struct sockaddr_in *)&clnt_addr)->sin_family == AF_INET6) {
-                                thr_arg arg;
-
-                                if(lstn->disabled) {
-                                    /*
-                                    addr2str(tmp, MAXBUF - 1, &clnt_addr, 1);
-                                    logmsg(LOG_WARNING, "HTTP disabled listener from %s", tmp);
-                                    */
-                                    close(clnt);
-                                }
-                                arg.sock = clnt;
-                                arg.lstn = lstn;
-                                if((arg.from_host.ai_addr = (struct sockaddr *)malloc(clnt_length)) == NULL) {
-                                    logmsg(LOG_WARNING, "HTTP arg address: malloc");
-                                    close(clnt);
-                                    continue;
-                                }
-                                memcpy(arg.from_host.ai_addr, &clnt_addr, clnt_length);
-                                arg.from_host.ai_addrlen = clnt_length;
-                                if(((struct sockaddr_in *)&clnt_addr)->sin_family == AF_INET)
-                                    arg.from_host.ai_family = AF_INET;
-                                else
-                                    arg.from_host.ai_family = AF_INET6;
-                                if(put_thr_arg(&arg))
-                                    close(clnt);
-                            } else {
-                                /* may happen on FreeBSD, I am told */
-                                logmsg(LOG_WARNING, "HTTP connection prematurely closed by peer");
-                                close(clnt);
-                            }
-                        }
-                    }
+                    for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++)
+                        if(polls[i].revents & (POLLIN | POLLPRI))
+                            do_accept(lstn, polls[i].fd);
                 }
             }
 #ifdef  UPER
@@ -26,6 +26,12 @@
  */
 
 #include    "config.h"
+
+#if (HAVE_ACCEPT4 || HAVE_PTHREAD_SETAFFINITY_NP || HAVE_SPLICE) && !defined(_GNU_SOURCE)
+/* accept4(), splice() and the CPU affinity calls are GNU extensions */
+#define _GNU_SOURCE
+#endif
+
 #include    <stdio.h>
 #include    <math.h>
 
@@ -51,6 +57,10 @@
 #error "Pound needs pthread.h"
 #endif
 
+#if HAVE_PTHREAD_SETAFFINITY_NP
+#include    <sched.h>
+#endif
+
 #if HAVE_STRING_H
 #include    <string.h>
 #else
@@ -131,6 +141,27 @@
 #error "Pound needs sys/poll.h"
 #endif
 
+#if HAVE_SYS_EPOLL_H
+#include    <sys/epoll.h>
+#endif
+
+#if HAVE_LINUX_FUTEX_H
+#include    <linux/futex.h>
+#include    <sys/syscall.h>
+#endif
+
+#if HAVE_UCONTEXT_H
+#include    <ucontext.h>
+#endif
+
+#if HAVE_SYS_MMAN_H
+#include    <sys/mman.h>
+#endif
+
+#if HAVE_SYS_EPOLL_H && HAVE_UCONTEXT_H && HAVE_SWAPCONTEXT && HAVE_SYS_MMAN_H
+#define FIBERS  1
+#endif
+
 #if HAVE_OPENSSL_SSL_H
 #define OPENSSL_THREAD_DEFINES
 #include    <openssl/ssl.h>
@@ -267,6 +298,14 @@ extern char *user,              /* user to run as */
             *ctrl_name;         /* control socket name */
 
 extern int  numthreads,         /* number of worker threads */
+            min_threads,        /* minimal number of worker threads */
+            max_threads,        /* maximal number of worker threads */
+            idle_to,            /* idle worker threads above min_threads exit after this */
+            evt_threads,        /* number of event loop threads (0: no event engine) */
+            fiber_threads,      /* number of fiber scheduler threads (0: a worker thread per connection) */
+            park_keepalive,     /* park idle keep-alive connections in the event engine */
+            acceptors,          /* number of acceptor threads (SO_REUSEPORT shards) */
+            n_workers,          /* number of worker processes */
             anonymise,          /* anonymise client address */
             alive_to,           /* check interval for resurrection */
             daemonize,          /* run as daemon */
@@ -275,11 +314,7 @@ extern int  numthreads,         /* number of worker threads */
             grace,              /* grace period before shutdown */
             control_sock;       /* control socket */
 
-extern regex_t  HEADER,     /* Allowed header */
-                CHUNK_HEAD, /* chunk header line */
-                RESP_SKIP,  /* responses for which we skip response */
-                RESP_IGN,   /* responses for which we ignore content */
-                LOCATION,   /* the host we are redirected to */
+extern regex_t  LOCATION,   /* the host we are redirected to */
                 AUTHORIZATION;  /* the Authorisation header */
 
 #ifndef  SOL_TCP
@@ -287,14 +322,43 @@ extern regex_t  HEADER,     /* Allowed header */
 extern int  SOL_TCP;
 #endif
 
+#if HAVE_PTHREAD_SETAFFINITY_NP
+extern cpu_set_t    *acceptor_cpus, /* CPUs for the acceptor and event threads */
+                    *worker_cpus,   /* CPUs for the worker threads */
+                    *control_cpus;  /* CPUs for the timer and control threads */
+#endif
+
 #endif /* NO_EXTERNALS */
 
 #ifndef MAXBUF
 #define MAXBUF      4096
 #endif
 
+/* default max. number of lines in a request/response (MaxHeaders is one less) */
 #define MAXHEADERS  128
 
+/* relay buffers for bodies start at RELAY_MIN and grow up to RELAY_MAX while the transfers fill them */
+#define RELAY_MIN   (4 * MAXBUF)
+#define RELAY_MAX   (64 * MAXBUF)
+
+/* default memory a listener may hold in relay buffers */
+#define RELAY_BUDGET    (64 * RELAY_MAX)
+
+#ifndef ACCEPT_BATCH
+/* max. connections accepted on a listener per wake-up */
+#define ACCEPT_BATCH    64
+#endif
+
+#ifdef  __linux__
+/* accepted sockets inherit SO_KEEPALIVE, SO_LINGER, TCP_LINGER2 and TCP_NODELAY from the listener */
+#define INHERIT_SOCKOPTS
+#endif
+
+#ifndef ARG_QUEUE
+/* size of the work queue - must be a power of 2 */
+#define ARG_QUEUE   8192
+#endif
+
 #ifndef F_CONF
 #define F_CONF  "/usr/local/etc/pound.cfg"
 #endif
@@ -304,8 +368,16 @@ extern int  SOL_TCP;
 #endif
 
 /* matcher chain */
+/* a literal every match of a pattern contains - lines without it need not be matched at all */
+typedef struct {
+    char                str[32];    /* in lower case (the patterns ignore case) - may be empty */
+    int                 len;
+    int                 start;      /* true if a match starts the line, so the line starts with it */
+}   LITERAL;
+
 typedef struct _matcher {
     regex_t             pat;        /* pattern to match the request/header against */
+    LITERAL             lit;        /* for header patterns (see set_literal) */
     struct _matcher     *next;
 }   MATCHER;
 
@@ -363,6 +435,7 @@ typedef struct _service {
     int                 sess_ttl;   /* session time-to-live */
     regex_t             sess_start; /* pattern to identify the session data */
     regex_t             sess_pat;   /* pattern to match the session data */
+    LITERAL             sess_lit;   /* a literal any header matching sess_start contains */
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
     LHASH_OF(TABNODE)   *sessions;  /* currently active sessions */
 #else
@@ -377,6 +450,14 @@ typedef struct _service {
 extern SERVICE          *services;  /* global services (if any) */
 #endif /* NO_EXTERNALS */
 
+/* the services of a configuration - replaced as a whole on reload */
+typedef struct _svc_conf {
+    SERVICE             *services;  /* global services */
+    SERVICE             **lstn_svc; /* the services of each listener (in listener order) */
+    int                 n_lstn;
+    int                 refs;       /* connections using it (+1 while it is the current one) */
+}   SVC_CONF;
+
 typedef struct _pound_ctx {
     SSL_CTX             *ctx;
     char                *server_name;
@@ -389,11 +470,13 @@ typedef struct _pound_ctx {
 typedef struct _listener {
     struct addrinfo     addr;               /* IPv4/6 address */
     int                 sock;               /* listening socket */
+    int                 *shards;            /* all listening sockets (one per acceptor) */
+    int                 n_shards;           /* number of listening sockets */
     POUND_CTX           *ctx;               /* CTX for SSL connections */
     int                 clnt_check;         /* client verification mode */
     int                 noHTTPS11;          /* HTTP 1.1 mode for SSL */
     char                *add_head;          /* extra SSL header */
-    regex_t             verb;               /* pattern to match the request verb against */
+    int                 xhttp;              /* request methods allowed (xHTTP level) */
     int                 to;                 /* client time-out */
     int                 has_pat;            /* was a URL pattern defined? */
     regex_t             url_pat;            /* pattern to match the request URL against */
@@ -402,10 +485,24 @@ typedef struct _listener {
                         *err501,
                         *err503;
     LONG                max_req;            /* max. request size */
+    int                 max_head;           /* max. size of the request line or a header */
+    int                 max_headers;        /* max. number of headers */
+    int                 buf_size;           /* size of the client and back-end I/O buffers */
+    int                 pipeline;           /* max. requests forwarded ahead of a response (0: none) */
+    int                 relay_budget;       /* max. memory in relay buffers (0: none, MAXBUF on the stack) */
+    volatile int        relay_used;         /* memory in relay buffers now */
     MATCHER             *head_off;          /* headers to remove */
     int                 rewr_loc;           /* rewrite location response */
     int                 rewr_dest;          /* rewrite destination header */
     int                 disabled;           /* true if the listener is disabled */
+    int                 defer_accept;       /* TCP_DEFER_ACCEPT time-out (0: none) */
+    int                 weight;             /* weight of the own work queue (0: use the shared one) */
+    int                 reserved;           /* number of worker threads serving only this listener */
+    struct _work_queue  *queue;             /* own work queue (if any) */
+    int                 max_queue;          /* max. requests queued for this listener (0: no limit) */
+    int                 max_wait;           /* max. time a request may wait in the queue (ms, 0: no limit) */
+    volatile int        n_queued;           /* requests currently queued */
+    volatile unsigned long  rejected;       /* requests turned away because of the above */
     int                 log_level;          /* log level for this listener */
     int                 allow_client_reneg; /* Allow Client SSL Renegotiation */
     int                 disable_ssl_v2;     /* Disable SSL version 2 */
@@ -420,8 +517,11 @@ extern LISTENER         *listeners; /* all available listeners */
 typedef struct _thr_arg {
     int             sock;
     LISTENER        *lstn;
-    struct addrinfo from_host;
-    struct _thr_arg *next;
+    struct addrinfo from_host;      /* ai_addr is not set - the address is in from_addr */
+    struct sockaddr_storage from_addr;
+    double          queued;         /* time it was put on the queue (ms, only if lstn->max_wait) */
+    SVC_CONF        *conf;          /* services used for the connection (set by the worker) */
+    struct _http_conn *conn;        /* state of a parked keep-alive connection (NULL: new one) */
 }   thr_arg;                        /* argument to processing threads: socket, origin */
 
 /* Track SSL handshare/renegotiation so we can reject client-renegotiations. */
@@ -440,6 +540,41 @@ typedef enum { RENEG_INIT=0, RENEG_REJECT, RENEG_ALLOW, RENEG_ABORT } RENEG_STAT
 #define HEADER_USER_AGENT           8
 #define HEADER_URI                  9
 #define HEADER_DESTINATION          10
+#define HEADER_AUTHORIZATION        11
+
+/* Request methods the code tells apart - index in the method table in svc.c */
+#define METH_GET                    0
+#define METH_HEAD                   2
+#define METH_RPC_IN_DATA            29
+#define METH_RPC_OUT_DATA           30
+
+/*
+ * The header lines of a request or response, one after the other (each NUL-terminated)
+ * in one buffer that is reused for the next message. Line 0 is the request/status line.
+ */
+typedef struct {
+    char    *buf;               /* the lines */
+    int     size;               /* allocated size of buf */
+    int     used;               /* bytes of buf in use */
+    int     n;                  /* number of lines */
+    int     max;                /* number of lines the index below has room for */
+    int     *off;               /* offset of each line in buf */
+    int     *len;               /* length of each line */
+    int     *type;              /* header type (HEADER_*) of each line */
+    int     *val;               /* offset of the header content in the line */
+    char    *ok;                /* line to be passed on */
+}   HEADERS;
+
+#define HDR(h, i)       ((h)->buf + (h)->off[i])
+#define HDR_VAL(h, i)   (HDR(h, i) + (h)->val[i])
+
+/* a parsed request line - the URL is a span of the line */
+typedef struct {
+    int     method;         /* index in the method table */
+    int     url;            /* offset of the URL in the line */
+    int     url_len;        /* length of the URL */
+    int     http11;         /* HTTP/1.1 (or 1.0) */
+}   REQ_LINE;
 
 /* control request stuff */
 typedef enum    {
@@ -447,7 +582,8 @@ typedef enum    {
     CTRL_EN_LSTN, CTRL_DE_LSTN,
     CTRL_EN_SVC, CTRL_DE_SVC,
     CTRL_EN_BE, CTRL_DE_BE,
-    CTRL_ADD_SESS, CTRL_DEL_SESS
+    CTRL_ADD_SESS, CTRL_DEL_SESS,
+    CTRL_RELOAD
 }   CTRL_CODE;
 
 typedef struct  {
@@ -479,20 +615,85 @@ typedef u_int32_t   time_t;
 extern int  put_thr_arg(thr_arg *);
 
 /*
- * get a request from the queue
+ * get a request from the queue (for a worker reserved to a listener or a shared one if NULL)
+ * returns -1 if the calling (idle) worker should exit
  */
-extern thr_arg  *get_thr_arg(void);
+extern int  get_thr_arg(LISTENER *, thr_arg *);
 
 /*
  * get the current queue length
  */
-extern  get_thr_qlen(void);
+extern  int get_thr_qlen(void);
+
+/*
+ * get the current number of worker threads (all/idle)
+ */
+extern  int get_thr_count(void);
+extern  int get_thr_idle(void);
+
+/*
+ * start a new worker thread (unless there are max_threads already)
+ */
+extern int  new_worker(void);
+
+/*
+ * set the TCP options (keep-alive, linger, no delay) for a socket
+ */
+extern void set_sock_opts(const int);
+
+/*
+ * pin the calling thread to the CPUs configured for its kind
+ */
+#define AFF_ACCEPT  0
+#define AFF_WORKER  1
+#define AFF_CONTROL 2
+extern void set_affinity(const int);
+
+/*
+ * hand a connection to the event engine: it is queued for the workers once readable
+ */
+extern int  evt_add(thr_arg *);
+
+/*
+ * start the event engine threads
+ */
+extern void evt_init(void);
+
+/*
+ * hand a connection to the least loaded fiber scheduler
+ */
+extern int  fiber_add(thr_arg *);
+
+/*
+ * start the fiber scheduler threads
+ */
+extern void fiber_init(void);
+
+/*
+ * poll() a single descriptor - in a fiber the scheduler runs the others meanwhile
+ */
+extern int  fiber_poll(struct pollfd *, const int);
 
 /*
  * handle an HTTP request
  */
 extern void *thr_http(void *);
 
+/*
+ * handle the connection in arg - to the end, or until it is parked (arg->conn then set)
+ */
+extern void do_http(thr_arg *);
+
+/*
+ * close a parked keep-alive connection and release its services
+ */
+extern void http_drop(thr_arg *);
+
+/*
+ * turn a client away without processing (queue over budget): 503 for HTTP, reset for HTTPS
+ */
+extern void reject_conn(thr_arg *);
+
 /*
  * Log an error to the syslog or to stderr
  */
@@ -516,12 +717,21 @@ extern void addr2str(char *, const int, const struct addrinfo *, const int);
 /*
  * Find the right service for a request
  */
-extern SERVICE  *get_service(const LISTENER *, const char *, char **const);
+extern SERVICE  *get_service(const SVC_CONF *, const LISTENER *, const char *, const HEADERS *);
+
+/*
+ * the current service configuration: take/release a reference, make the first one from the
+ * parsed lists, replace it on reload (sessions of unchanged services are carried over)
+ */
+extern SVC_CONF *get_svc_conf(void);
+extern void put_svc_conf(SVC_CONF *);
+extern void init_svc_conf(void);
+extern void set_svc_conf(SVC_CONF *);
 
 /*
  * Find the right back-end for a request
  */
-extern BACKEND  *get_backend(SERVICE *const, const struct addrinfo *, const char *, char **const);
+extern BACKEND  *get_backend(SERVICE *const, const struct addrinfo *, const char *, const HEADERS *);
 
 /*
  * Search for a host name, return the addrinfo for it
@@ -538,12 +748,27 @@ extern int  need_rewrite(const int, char *const, char *const, const char *, cons
 /*
  * (for cookies only) possibly create session based on response headers
  */
-extern void upd_session(SERVICE *const, char **const, BACKEND *const);
+extern void upd_session(SERVICE *const, const HEADERS *, BACKEND *const);
 
 /*
  * Parse a header
  */
-extern int  check_header(const char *, char *);
+extern int  check_header(const char *, int *const);
+
+/*
+ * May a header line match a pattern with the given literal? (0: certainly not)
+ */
+extern int  has_literal(const LITERAL *, const char *);
+
+/*
+ * Parse a request line, accepting the methods of the given xHTTP level (0: OK, -1: bad request)
+ */
+extern int  parse_request(const char *, const int, REQ_LINE *const);
+
+/*
+ * Parse a response status line: the status code, or -1 if malformed
+ */
+extern int  parse_status(const char *);
 
 #define BE_DISABLE  -1
 #define BE_KILL     1
@@ -585,6 +810,11 @@ extern int  connect_nb(const int, const struct addrinfo *, const int);
  */
 extern void config_parse(const int, char **const);
 
+/*
+ * Re-read the services from the config file (NULL on error)
+ */
+extern SVC_CONF *config_reload(void);
+
 /*
  * RSA ephemeral keys: how many and how often
  */
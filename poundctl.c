@@ -43,6 +43,7 @@ usage(const char *arg0)
     fprintf(stderr, "\t-b n m r - disable back-end r in service m in listener n\n");
     fprintf(stderr, "\t-N n m k r - add a session with key k and back-end r in service m in listener n\n");
     fprintf(stderr, "\t-n n m k - remove a session with key k r in service m in listener n\n");
+    fprintf(stderr, "\t-R - reload the services from the configuration file\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "\tentering the command without arguments lists the current configuration.\n");
     fprintf(stderr, "\tthe -X flag results in XML output.\n");
@@ -216,7 +217,7 @@ main(const int argc, char **argv)
     CTRL_CMD    cmd;
     int         sock, n_lstn, n_svc, n_be, n_sess, i;
     char        *arg0, *sock_name, buf[KEY_SIZE + 1];
-    int         c_opt, en_lst, de_lst, en_svc, de_svc, en_be, de_be, a_sess, d_sess, is_set;
+    int         c_opt, en_lst, de_lst, en_svc, de_svc, en_be, de_be, a_sess, d_sess, reload, is_set;
     LISTENER    lstn;
     SERVICE     svc;
     BACKEND     be;
@@ -225,11 +226,11 @@ main(const int argc, char **argv)
 
     arg0 = *argv;
     sock_name = NULL;
-    en_lst = de_lst = en_svc = de_svc = en_be = de_be = is_set = a_sess = d_sess = 0;
+    en_lst = de_lst = en_svc = de_svc = en_be = de_be = is_set = a_sess = d_sess = reload = 0;
     memset(&cmd, 0, sizeof(cmd));
     opterr = 0;
     i = 0;
-    while(!i && (c_opt = getopt(argc, argv, "c:LlSsBbNnXH")) > 0)
+    while(!i && (c_opt = getopt(argc, argv, "c:LlSsBbNnRXH")) > 0)
         switch(c_opt) {
         case 'c':
             sock_name = optarg;
@@ -277,6 +278,11 @@ main(const int argc, char **argv)
                 usage(arg0);
             d_sess = is_set = 1;
             break;
+        case 'R':
+            if(is_set)
+                usage(arg0);
+            reload = is_set = 1;
+            break;
         case 'H':
             host_names = 1;
             break;
@@ -332,6 +338,11 @@ main(const int argc, char **argv)
         cmd.service = atoi(argv[optind++]);
         strncpy(cmd.key, argv[optind++], KEY_SIZE);
     }
+    if(reload) {
+        if(optind != argc)
+            usage(arg0);
+        cmd.cmd = CTRL_RELOAD;
+    }
     if(!is_set) {
         if(optind != argc)
             usage(arg0);
@@ -342,7 +353,7 @@ main(const int argc, char **argv)
     write(sock, &cmd, sizeof(cmd));
 
     if (!is_set) {
-        int n;
+        int n, n_thr, n_idle;
 
         n_lstn = 0;
         if(xml_out)
@@ -352,15 +363,24 @@ main(const int argc, char **argv)
                 printf("<queue size=\"%d\"/>\n", n);
             else
                 printf("Requests in queue: %d\n", n);
+        if(read(sock, &n_thr, sizeof(n_thr)) == sizeof(n_thr) && read(sock, &n_idle, sizeof(n_idle)) == sizeof(n_idle)) {
+            if(xml_out)
+                printf("<threads total=\"%d\" idle=\"%d\"/>\n", n_thr, n_idle);
+            else
+                printf("Worker threads: %d (%d idle)\n", n_thr, n_idle);
+        }
         while(read(sock, (void *)&lstn, sizeof(LISTENER)) == sizeof(LISTENER)) {
             if(lstn.disabled < 0)
                 break;
             read(sock, &a, lstn.addr.ai_addrlen);
             lstn.addr.ai_addr = (struct sockaddr *)&a;
             if(xml_out)
-                printf("<listener index=\"%d\" protocol=\"%s\" address=\"%s\" status=\"%s\">\n",
+                printf("<listener index=\"%d\" protocol=\"%s\" address=\"%s\" status=\"%s\" rejected=\"%lu\">\n",
                     n_lstn++, lstn.ctx? "HTTPS": "http",
-                    prt_addr(&lstn.addr), lstn.disabled? "DISABLED": "active");
+                    prt_addr(&lstn.addr), lstn.disabled? "DISABLED": "active", lstn.rejected);
+            else if(lstn.rejected > 0)
+                printf("%3d. %s Listener %s %s (%lu rejected)\n", n_lstn++, lstn.ctx? "HTTPS" : "http",
+                    prt_addr(&lstn.addr), lstn.disabled? "*D": "a", lstn.rejected);
             else
                 printf("%3d. %s Listener %s %s\n", n_lstn++, lstn.ctx? "HTTPS" : "http",
                     prt_addr(&lstn.addr), lstn.disabled? "*D": "a");
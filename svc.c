@@ -210,6 +210,56 @@ t_clean(LHASH_OF(TABNODE) *const tab, void *const content, const size_t cont_len
     return;
 }
 
+typedef struct  {
+    LHASH_OF(TABNODE)   *tab;
+    BACKEND             *backends;
+}   MOVE_ARG;
+
+static void
+t_move_doall_arg(TABNODE *t, MOVE_ARG *a)
+{
+    BACKEND *old, *be;
+    TABNODE *res;
+
+    /* the same back-end in the new service: same address (or redirect) */
+    old = *(BACKEND **)t->content;
+    for(be = a->backends; be; be = be->next)
+        if(be->be_type == old->be_type && be->addr.ai_addrlen == old->addr.ai_addrlen
+        && (be->addr.ai_addrlen == 0 || !memcmp(be->addr.ai_addr, old->addr.ai_addr, be->addr.ai_addrlen))
+        && (be->url == NULL || old->url == NULL || !strcmp(be->url, old->url)))
+            break;
+    if(be == NULL)
+        return;
+    t_add(a->tab, t->key, &be, sizeof(be));
+    if((res = (TABNODE *)lh_retrieve(a->tab, t)) != NULL)
+        res->last_acc = t->last_acc;
+    return;
+}
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+IMPLEMENT_LHASH_DOALL_ARG_FN(t_move, TABNODE, MOVE_ARG)
+#else
+#define t_move t_move_doall_arg
+IMPLEMENT_LHASH_DOALL_ARG_FN(t_move, TABNODE *, MOVE_ARG *)
+#endif
+
+/*
+ * Copy the nodes to the table of a new service, mapping them to its back-ends
+ */
+static void
+t_copy(LHASH_OF(TABNODE) *const from, LHASH_OF(TABNODE) *const to, BACKEND *const backends)
+{
+    MOVE_ARG    a;
+
+    a.tab = to;
+    a.backends = backends;
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+    LHM_lh_doall_arg(TABNODE, from, LHASH_DOALL_ARG_FN(t_move), MOVE_ARG, &a);
+#else
+    lh_doall_arg(from, LHASH_DOALL_ARG_FN(t_move), &a);
+#endif
+    return;
+}
+
 /*
  * Log an error to the syslog or to stderr
  */
@@ -260,6 +310,29 @@ va_dcl
 }
 #endif
 
+/*
+ * set the TCP options (keep-alive, linger, no delay) for a socket
+ */
+void
+set_sock_opts(const int sock)
+{
+    int             n;
+    struct linger   l;
+
+    n = 1;
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&n, sizeof(n));
+    l.l_onoff = 1;
+    l.l_linger = 10;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
+#ifdef  TCP_LINGER2
+    n = 5;
+    setsockopt(sock, SOL_TCP, TCP_LINGER2, (void *)&n, sizeof(n));
+#endif
+    n = 1;
+    setsockopt(sock, SOL_TCP, TCP_NODELAY, (void *)&n, sizeof(n));
+    return;
+}
+
 /*
  * Translate inet/inet6 address/port into a string
  */
@@ -310,8 +383,8 @@ addr2str(char *const res, const int res_len, const struct addrinfo *addr, const
 int
 cpURL(char *res, char *src, int len)
 {
-    int     state;
-    char    *kp_res;
+    int     state, run;
+    char    *kp_res, *esc;
 
     for(kp_res = res, state = 0; len > 0; len--)
         switch(state) {
@@ -352,9 +425,16 @@ cpURL(char *res, char *src, int len)
             }
             break;
         default:
-            if(*src != '%')
-                *res++ = *src++;
-            else {
+            if(*src != '%') {
+                /* copy the whole run up to the next escape at once (the loop accounts for one byte) */
+                if((esc = (char *)memchr(src, '%', len)) == NULL)
+                    esc = src + len;
+                run = esc - src;
+                memcpy(res, src, run);
+                res += run;
+                src += run;
+                len -= run - 1;
+            } else {
                 src++;
                 state = 1;
             }
@@ -368,51 +448,178 @@ cpURL(char *res, char *src, int len)
     return res - kp_res;
 }
 
+/*
+ * The request methods with the lowest xHTTP level that allows each of them
+ * (the METH_* values in pound.h index this table)
+ */
+static struct {
+    char    *name;
+    int     len;
+    int     level;
+}   methods[] = {
+    { "GET",            3,  0 },
+    { "POST",           4,  0 },
+    { "HEAD",           4,  0 },
+    { "PUT",            3,  1 },
+    { "DELETE",         6,  1 },
+    { "LOCK",           4,  2 },
+    { "UNLOCK",         6,  2 },
+    { "PROPFIND",       8,  2 },
+    { "PROPPATCH",      9,  2 },
+    { "SEARCH",         6,  2 },
+    { "MKCOL",          5,  2 },
+    { "MOVE",           4,  2 },
+    { "COPY",           4,  2 },
+    { "OPTIONS",        7,  2 },
+    { "TRACE",          5,  2 },
+    { "MKACTIVITY",     10, 2 },
+    { "CHECKOUT",       8,  2 },
+    { "MERGE",          5,  2 },
+    { "REPORT",         6,  2 },
+    { "SUBSCRIBE",      9,  3 },
+    { "UNSUBSCRIBE",    11, 3 },
+    { "BPROPPATCH",     10, 3 },
+    { "POLL",           4,  3 },
+    { "BMOVE",          5,  3 },
+    { "BCOPY",          5,  3 },
+    { "BDELETE",        7,  3 },
+    { "BPROPFIND",      9,  3 },
+    { "NOTIFY",         6,  3 },
+    { "CONNECT",        7,  3 },
+    { "RPC_IN_DATA",    11, 4 },
+    { "RPC_OUT_DATA",   12, 4 },
+    { NULL,             0,  0 }
+};
+
+/*
+ * Parse a request line in a single pass, without copying: "METHOD URL HTTP/1.x", separated
+ * by single spaces, the method (any case) being one allowed at the xHTTP level
+ * return 0 and the method, URL span and version in req, or -1 for a bad request
+ */
+int
+parse_request(const char *line, const int level, REQ_LINE *const req)
+{
+    const char  *p;
+    int         n;
+
+    for(p = line; *p && *p != ' '; p++)
+        ;
+    if(*p != ' ')
+        return -1;
+    for(n = 0; methods[n].name; n++)
+        if(methods[n].len == p - line && methods[n].level <= level && !strncasecmp(line, methods[n].name, p - line))
+            break;
+    if(methods[n].name == NULL)
+        return -1;
+    req->method = n;
+
+    req->url = ++p - line;
+    while(*p && *p != ' ' && *p != '\n')
+        p++;
+    if((req->url_len = p - line - req->url) == 0 || *p++ != ' ')
+        return -1;
+
+    /* the version: "HTTP/1" + any one character + "0" or "1" */
+    if(strncasecmp(p, "HTTP/1", 6) || p[6] == '\0' || p[6] == '\n' || (p[7] != '0' && p[7] != '1') || p[8])
+        return -1;
+    req->http11 = (p[7] == '1');
+    return 0;
+}
+
+/*
+ * Parse a response status line "HTTP/1.x nnn ..."
+ * return the status code, or -1 if the line is malformed
+ */
+int
+parse_status(const char *line)
+{
+    if(strncasecmp(line, "HTTP/1", 6) || line[6] == '\0' || line[6] == '\n' || (line[7] != '0' && line[7] != '1')
+    || line[8] != ' ' || !isdigit(line[9]) || !isdigit(line[10]) || !isdigit(line[11]))
+        return -1;
+    return (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+}
+
+/*
+ * the header names we tell apart, placed at their hash slot (see hd_hash)
+ */
+static const struct {
+    char    name[20];
+    int     len;
+    int     val;
+} hd_types[16] = {
+    [0]  = { "Authorization",      13, HEADER_AUTHORIZATION },
+    [1]  = { "Referer",            7,  HEADER_REFERER },
+    [3]  = { "Destination",        11, HEADER_DESTINATION },
+    [4]  = { "Host",               4,  HEADER_HOST },
+    [5]  = { "Connection",         10, HEADER_CONNECTION },
+    [7]  = { "User-agent",         10, HEADER_USER_AGENT },
+    [8]  = { "Location",           8,  HEADER_LOCATION },
+    [11] = { "Transfer-encoding",  17, HEADER_TRANSFER_ENCODING },
+    [13] = { "Content-length",     14, HEADER_CONTENT_LENGTH },
+    [15] = { "Content-location",   16, HEADER_CONTLOCATION },
+};
+
+/* perfect hash of the names above: length, first and last character (case-insensitive) */
+#define hd_hash(name, len)  (((len) ^ ((name)[0] | 0x20) ^ (((name)[(len) - 1] | 0x20) << 1)) & 0x0f)
+
+/* characters allowed in a header name (RFC 7230 token) */
+static int
+is_tchar(const int c)
+{
+    if(isalnum(c))
+        return 1;
+    switch(c) {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+':
+    case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+        return 1;
+    }
+    return 0;
+}
+
 /*
  * Parse a header
- * return a code and possibly content in the arg
+ * return a code and the offset of the content in the arg
  */
 int
-check_header(const char *header, char *const content)
+check_header(const char *header, int *const val)
 {
-    regmatch_t  matches[4];
-    static struct {
-        char    header[32];
-        int     len;
-        int     val;
-    } hd_types[] = {
-        { "Transfer-encoding",  17, HEADER_TRANSFER_ENCODING },
-        { "Content-length",     14, HEADER_CONTENT_LENGTH },
-        { "Connection",         10, HEADER_CONNECTION },
-        { "Location",           8,  HEADER_LOCATION },
-        { "Content-location",   16, HEADER_CONTLOCATION },
-        { "Host",               4,  HEADER_HOST },
-        { "Referer",            7,  HEADER_REFERER },
-        { "User-agent",         10, HEADER_USER_AGENT },
-        { "Destination",        11, HEADER_DESTINATION },
-        { "",                   0,  HEADER_OTHER },
-    };
-    int i;
-
-    if(!regexec(&HEADER, header, 4, matches, 0)) {
-        for(i = 0; hd_types[i].len > 0; i++)
-            if((matches[1].rm_eo - matches[1].rm_so) == hd_types[i].len
-            && strncasecmp(header + matches[1].rm_so, hd_types[i].header, hd_types[i].len) == 0) {
-                /* we know that the original header was read into a buffer of size MAXBUF, so no overflow */
-                strncpy(content, header + matches[2].rm_so, matches[2].rm_eo - matches[2].rm_so);
-                content[matches[2].rm_eo - matches[2].rm_so] = '\0';
-                return hd_types[i].val;
-            }
+    int     len, i, h;
+
+    for(len = 0; is_tchar((unsigned char)header[len]); len++)
+        ;
+    if(len > 0 && header[len] == ':') {
+        for(i = len + 1; header[i] == ' ' || header[i] == '\t'; i++)
+            ;
+        *val = i;
+        h = hd_hash(header, len);
+        if(hd_types[h].len == len && strncasecmp(header, hd_types[h].name, len) == 0)
+            return hd_types[h].val;
         return HEADER_OTHER;
     } else if(header[0] == ' ' || header[0] == '\t') {
-        *content = '\0';
+        *val = strlen(header);
         return HEADER_OTHER;
     } else
         return HEADER_ILLEGAL;
 }
 
+/*
+ * May header line lin match a pattern with literal lit? A cheap test that spares most lines the regexec
+ */
+int
+has_literal(const LITERAL *lit, const char *lin)
+{
+    if(lit->len == 0)
+        return 1;
+    if(lit->start)
+        return strncasecmp(lin, lit->str, lit->len) == 0;
+    for(; *lin; lin++)
+        if(tolower((unsigned char)*lin) == lit->str[0] && strncasecmp(lin, lit->str, lit->len) == 0)
+            return 1;
+    return 0;
+}
+
 static int
-match_service(const SERVICE *svc, const char *request, char **const headers)
+match_service(const SERVICE *svc, const char *request, const HEADERS *headers)
 {
     MATCHER *m;
     int     i, found;
@@ -424,8 +631,8 @@ match_service(const SERVICE *svc, const char *request, char **const headers)
 
     /* check for required headers */
     for(m = svc->req_head; m; m = m->next) {
-        for(found = i = 0; i < (MAXHEADERS - 1) && !found; i++)
-            if(headers[i] && !regexec(&m->pat, headers[i], 0, NULL, 0))
+        for(found = 0, i = 1; i < headers->n && !found; i++)
+            if(has_literal(&m->lit, HDR(headers, i)) && !regexec(&m->pat, HDR(headers, i), 0, NULL, 0))
                 found = 1;
         if(!found)
             return 0;
@@ -433,8 +640,8 @@ match_service(const SERVICE *svc, const char *request, char **const headers)
 
     /* check for forbidden headers */
     for(m = svc->deny_head; m; m = m->next) {
-        for(found = i = 0; i < (MAXHEADERS - 1) && !found; i++)
-            if(headers[i] && !regexec(&m->pat, headers[i], 0, NULL, 0))
+        for(found = 0, i = 1; i < headers->n && !found; i++)
+            if(has_literal(&m->lit, HDR(headers, i)) && !regexec(&m->pat, HDR(headers, i), 0, NULL, 0))
                 found = 1;
         if(found)
             return 0;
@@ -447,11 +654,15 @@ match_service(const SERVICE *svc, const char *request, char **const headers)
  * Find the right service for a request
  */
 SERVICE *
-get_service(const LISTENER *lstn, const char *request, char **const headers)
+get_service(const SVC_CONF *conf, const LISTENER *lstn, const char *request, const HEADERS *headers)
 {
-    SERVICE *svc;
+    LISTENER    *l;
+    SERVICE     *svc;
+    int         i;
 
-    for(svc = lstn->services; svc; svc = svc->next) {
+    for(l = listeners, i = 0; l != lstn; l = l->next, i++)
+        ;
+    for(svc = conf->lstn_svc[i]; svc; svc = svc->next) {
         if(svc->disabled)
             continue;
         if(match_service(svc, request, headers))
@@ -459,7 +670,7 @@ get_service(const LISTENER *lstn, const char *request, char **const headers)
     }
 
     /* try global services */
-    for(svc = services; svc; svc = svc->next) {
+    for(svc = conf->services; svc; svc = svc->next) {
         if(svc->disabled)
             continue;
         if(match_service(svc, request, headers))
@@ -470,6 +681,194 @@ get_service(const LISTENER *lstn, const char *request, char **const headers)
     return NULL;
 }
 
+/*
+ * service configuration stuff
+ *
+ * On reload the services are replaced as a whole. Every connection keeps the configuration
+ * that was current when it started (counted in refs) and the last one to let go of a replaced
+ * configuration frees it. The timer and control threads only look at the current services
+ * (lstn->services and services) and hold conf_mut while doing so.
+ */
+static SVC_CONF         *cur_conf = NULL;
+static pthread_mutex_t  ref_mut = PTHREAD_MUTEX_INITIALIZER;   /* cur_conf and all refs */
+static pthread_mutex_t  conf_mut = PTHREAD_MUTEX_INITIALIZER;  /* the current services */
+
+static void
+free_be(BACKEND *be)
+{
+    if(be->addr.ai_addr != NULL)
+        free(be->addr.ai_addr);
+    if(be->ha_addr.ai_addr != NULL)
+        free(be->ha_addr.ai_addr);
+    if(be->url != NULL)
+        free(be->url);
+    if(be->ctx != NULL)
+        SSL_CTX_free(be->ctx);
+    pthread_mutex_destroy(&be->mut);
+    free(be);
+    return;
+}
+
+static void
+free_matchers(MATCHER *m)
+{
+    MATCHER *next;
+
+    for(; m; m = next) {
+        next = m->next;
+        regfree(&m->pat);
+        free(m);
+    }
+    return;
+}
+
+static void
+free_services(SERVICE *svc)
+{
+    SERVICE *next;
+    BACKEND *be, *be_next;
+
+    for(; svc; svc = next) {
+        next = svc->next;
+        free_matchers(svc->url);
+        free_matchers(svc->req_head);
+        free_matchers(svc->deny_head);
+        for(be = svc->backends; be; be = be_next) {
+            be_next = be->next;
+            free_be(be);
+        }
+        if(svc->emergency != NULL)
+            free_be(svc->emergency);
+        if(svc->sess_type != SESS_NONE) {
+            regfree(&svc->sess_start);
+            regfree(&svc->sess_pat);
+        }
+        t_expire(svc->sessions, time(NULL) + 1);
+        lh_free(svc->sessions);
+        pthread_mutex_destroy(&svc->mut);
+        free(svc);
+    }
+    return;
+}
+
+/*
+ * take a reference to the current configuration
+ */
+SVC_CONF *
+get_svc_conf(void)
+{
+    SVC_CONF    *res;
+
+    pthread_mutex_lock(&ref_mut);
+    res = cur_conf;
+    res->refs++;
+    pthread_mutex_unlock(&ref_mut);
+    return res;
+}
+
+/*
+ * release a reference - free the configuration if it was replaced and this was the last one
+ */
+void
+put_svc_conf(SVC_CONF *conf)
+{
+    int i, last;
+
+    pthread_mutex_lock(&ref_mut);
+    last = (--conf->refs == 0);
+    pthread_mutex_unlock(&ref_mut);
+    if(!last)
+        return;
+    free_services(conf->services);
+    for(i = 0; i < conf->n_lstn; i++)
+        free_services(conf->lstn_svc[i]);
+    free(conf->lstn_svc);
+    free(conf);
+    return;
+}
+
+/*
+ * the initial configuration: the services as parsed at start-up
+ */
+void
+init_svc_conf(void)
+{
+    LISTENER    *lstn;
+    int         i;
+
+    if((cur_conf = (SVC_CONF *)calloc(1, sizeof(SVC_CONF))) == NULL) {
+        logmsg(LOG_ERR, "init_svc_conf: out of memory - aborted");
+        exit(1);
+    }
+    for(lstn = listeners; lstn; lstn = lstn->next)
+        cur_conf->n_lstn++;
+    if((cur_conf->lstn_svc = (SERVICE **)calloc(cur_conf->n_lstn, sizeof(SERVICE *))) == NULL) {
+        logmsg(LOG_ERR, "init_svc_conf: out of memory - aborted");
+        exit(1);
+    }
+    for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++)
+        cur_conf->lstn_svc[i] = lstn->services;
+    cur_conf->services = services;
+    cur_conf->refs = 1;
+    return;
+}
+
+/*
+ * carry the sessions over from the old services to the new ones with the same name (or the
+ * same position if unnamed) and session type
+ */
+static void
+carry_sessions(SERVICE *from, SERVICE *to)
+{
+    SERVICE *svc;
+    int     i, j, ret_val;
+
+    for(i = 0; to; to = to->next, i++) {
+        if(to->sess_type == SESS_NONE)
+            continue;
+        for(svc = from, j = 0; svc; svc = svc->next, j++)
+            if(to->name[0]? !strcmp(to->name, svc->name): j == i)
+                break;
+        if(svc == NULL || svc->sess_type != to->sess_type)
+            continue;
+        if(ret_val = pthread_mutex_lock(&svc->mut)) {
+            logmsg(LOG_WARNING, "carry_sessions() lock: %s", strerror(ret_val));
+            continue;
+        }
+        t_copy(svc->sessions, to->sessions, to->backends);
+        if(ret_val = pthread_mutex_unlock(&svc->mut))
+            logmsg(LOG_WARNING, "carry_sessions() unlock: %s", strerror(ret_val));
+    }
+    return;
+}
+
+/*
+ * make a (re-)parsed configuration the current one
+ */
+void
+set_svc_conf(SVC_CONF *conf)
+{
+    LISTENER    *lstn;
+    SVC_CONF    *old;
+    int         i;
+
+    pthread_mutex_lock(&conf_mut);
+    old = cur_conf;
+    carry_sessions(old->services, conf->services);
+    for(i = 0; i < conf->n_lstn; i++)
+        carry_sessions(old->lstn_svc[i], conf->lstn_svc[i]);
+    pthread_mutex_lock(&ref_mut);
+    conf->refs = 1;
+    cur_conf = conf;
+    pthread_mutex_unlock(&ref_mut);
+    for(lstn = listeners, i = 0; lstn; lstn = lstn->next, i++)
+        lstn->services = conf->lstn_svc[i];
+    services = conf->services;
+    pthread_mutex_unlock(&conf_mut);
+    put_svc_conf(old);
+    return;
+}
+
 /*
  * extract the session key for a given request
  */
@@ -496,24 +895,22 @@ get_REQUEST(char *res, const SERVICE *svc, const char *request)
 }
 
 static int
-get_HEADERS(char *res, const SERVICE *svc, char **const headers)
+get_HEADERS(char *res, const SERVICE *svc, const HEADERS *headers)
 {
     int         i, n, s;
     regmatch_t  matches[4];
 
     /* this will match SESS_COOKIE, SESS_HEADER and SESS_BASIC */
     res[0] = '\0';
-    for(i = 0; i < (MAXHEADERS - 1); i++) {
-        if(headers[i] == NULL)
-            continue;
-        if(regexec(&svc->sess_start, headers[i], 4, matches, 0))
+    for(i = 1; i < headers->n; i++) {
+        if(!has_literal(&svc->sess_lit, HDR(headers, i)) || regexec(&svc->sess_start, HDR(headers, i), 4, matches, 0))
             continue;
         s = matches[0].rm_eo;
-        if(regexec(&svc->sess_pat, headers[i] + s, 4, matches, 0))
+        if(regexec(&svc->sess_pat, HDR(headers, i) + s, 4, matches, 0))
             continue;
         if((n = matches[1].rm_eo - matches[1].rm_so) > KEY_SIZE)
             n = KEY_SIZE;
-        strncpy(res, headers[i] + s + matches[1].rm_so, n);
+        strncpy(res, HDR(headers, i) + s + matches[1].rm_so, n);
         res[n] = '\0';
     }
     return res[0] != '\0';
@@ -576,7 +973,7 @@ hash_backend(BACKEND *be, int abs_pri, char *key)
  * Find the right back-end for a request
  */
 BACKEND *
-get_backend(SERVICE *const svc, const struct addrinfo *from_host, const char *request, char **const headers)
+get_backend(SERVICE *const svc, const struct addrinfo *from_host, const char *request, const HEADERS *headers)
 {
     BACKEND     *res;
     char        key[KEY_SIZE + 1];
@@ -657,7 +1054,7 @@ get_backend(SERVICE *const svc, const struct addrinfo *from_host, const char *re
  * (for cookies/header only) possibly create session based on response headers
  */
 void
-upd_session(SERVICE *const svc, char **const headers, BACKEND *const be)
+upd_session(SERVICE *const svc, const HEADERS *headers, BACKEND *const be)
 {
     char            key[KEY_SIZE + 1];
     int             ret_val;
@@ -943,7 +1340,7 @@ connect_nb(const int sockfd, const struct addrinfo *serv_addr, const int to)
     memset(&p, 0, sizeof(p));
     p.fd = sockfd;
     p.events = POLLOUT;
-    if((res = poll(&p, 1, to * 1000)) != 1) {
+    if((res = fiber_poll(&p, to * 1000)) != 1) {
         if(res == 0) {
             /* timeout */
             logmsg(LOG_WARNING, "(%lx) connect_nb: poll timed out", pthread_self());
@@ -1493,6 +1890,7 @@ thr_timer(void *arg)
     time_t  last_time, cur_time;
     int     n_wait, n_remain;
 
+    set_affinity(AFF_CONTROL);
     n_wait = EXPIRE_TO;
     if(n_wait > alive_to)
         n_wait = alive_to;
@@ -1509,6 +1907,7 @@ thr_timer(void *arg)
             last_RSA = time(NULL);
             do_RSAgen();
         }
+        pthread_mutex_lock(&conf_mut);
         if((last_time - last_rescale) >= RESCALE_TO) {
             last_rescale = time(NULL);
             do_rescale();
@@ -1521,6 +1920,7 @@ thr_timer(void *arg)
             last_expire = time(NULL);
             do_expire();
         }
+        pthread_mutex_unlock(&conf_mut);
     }
 }
 
@@ -1645,6 +2045,7 @@ thr_control(void *arg)
     TABNODE         dummy_sess;
     struct pollfd   polls;
 
+    set_affinity(AFF_CONTROL);
     /* just to be safe */
     if(control_sock < 0)
         return NULL;
@@ -1673,11 +2074,16 @@ thr_control(void *arg)
             logmsg(LOG_WARNING, "thr_control() read: %s", strerror(errno));
             continue;
         }
+        pthread_mutex_lock(&conf_mut);
         switch(cmd.cmd) {
         case CTRL_LST:
             /* logmsg(LOG_INFO, "thr_control() list"); */
             n = get_thr_qlen();
             (void)write(ctl, (void *)&n, sizeof(n));
+            n = get_thr_count();
+            (void)write(ctl, (void *)&n, sizeof(n));
+            n = get_thr_idle();
+            (void)write(ctl, (void *)&n, sizeof(n));
             for(lstn = listeners; lstn; lstn = lstn->next) {
                 (void)write(ctl, (void *)lstn, sizeof(LISTENER));
                 (void)write(ctl, lstn->addr.ai_addr, lstn->addr.ai_addrlen);
@@ -1792,10 +2198,19 @@ thr_control(void *arg)
             if(ret_val = pthread_mutex_unlock(&svc->mut))
                 logmsg(LOG_WARNING, "thr_control() del session unlock: %s", strerror(ret_val));
             break;
+        case CTRL_RELOAD:
+            /* the reload is done by every worker process: the monitor passes the signal on */
+#ifdef  UPER
+            kill(getppid(), SIGUSR1);
+#else
+            kill(getpid(), SIGUSR1);
+#endif
+            break;
         default:
             logmsg(LOG_WARNING, "thr_control() unknown command");
             break;
         }
+        pthread_mutex_unlock(&conf_mut);
         close(ctl);
     }
 }